@@ -0,0 +1,303 @@
+/*
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+/*
+ * "make check":  drives libfxload against the fake device, so loads
+ * and EEPROM operations can be checked without hardware.  The firmware
+ * (normally a3load.hex) is loaded into RAM first, which also makes the
+ * fake act as the second stage loader the EEPROM operations need.
+ */
+
+# include  <stdio.h>
+# include  <errno.h>
+# include  <stdlib.h>
+# include  <string.h>
+# include  <unistd.h>
+
+# include  "ezusb.h"
+
+#define	EEPROM_SIZE	16384
+
+static const char	*firmware;
+static char		tmpdir [] = "/tmp/fxload-check-XXXXXX";
+static char		last [256];
+static int		failures;
+
+/* errors some checks expect are kept quiet, but shown if a check fails */
+static void check_log (void *arg, const char *message)
+{
+    snprintf (last, sizeof last, "%s", message);
+}
+
+static void check (int ok, const char *what)
+{
+    if (ok)
+	printf ("ok    %s\n", what);
+    else {
+	printf ("FAIL  %s\n", what);
+	if (last [0])
+	    printf ("      last message: %s", last);
+	failures++;
+    }
+    last [0] = 0;
+}
+
+static const char *tmpfile_path (const char *name)
+{
+    static char		path [sizeof tmpdir + 32];
+
+    snprintf (path, sizeof path, "%s/%s", tmpdir, name);
+    return path;
+}
+
+/* returns the file's contents, and its length in *len */
+static unsigned char *read_file (const char *path, size_t *len)
+{
+    FILE		*f = fopen (path, "rb");
+    unsigned char	*buf;
+
+    if (!f)
+	return NULL;
+    buf = malloc (EEPROM_SIZE * 2);
+    if (buf)
+	*len = fread (buf, 1, EEPROM_SIZE * 2, f);
+    fclose (f);
+    return buf;
+}
+
+static int write_file (const char *path, const unsigned char *buf, size_t len)
+{
+    FILE		*f = fopen (path, "wb");
+
+    if (!f)
+	return -1;
+    if (fwrite (buf, 1, len, f) != len) {
+	fclose (f);
+	return -1;
+    }
+    return fclose (f);
+}
+
+/* a fresh context on a fresh fake, with the firmware running */
+static struct ezusb *setup (struct ezusb_fake **fake, unsigned eeprom_size)
+{
+    struct ezusb	*dev = ezusb_new ();
+
+    *fake = ezusb_fake_new (1, eeprom_size);
+    if (!dev || !*fake) {
+	perror ("fake device");
+	exit (2);
+    }
+    ezusb_set_log (dev, check_log, NULL);
+    ezusb_set_transport (dev, &ezusb_fake_transport, *fake);
+    if (ezusb_load_ram (dev, firmware, 1, 0) != 0) {
+	fprintf (stderr, "can't load %s: %s", firmware, last);
+	exit (2);
+    }
+    return dev;
+}
+
+static void teardown (struct ezusb *dev, struct ezusb_fake *fake)
+{
+    ezusb_free (dev);
+    ezusb_fake_free (fake);
+}
+
+/* every data record of the hexfile must now be in RAM */
+static void check_ram (void)
+{
+    struct ezusb	*dev;
+    struct ezusb_fake	*fake;
+    FILE		*f;
+    char		line [600];
+    unsigned char	ram [256];
+    int			records = 0, ok = 1;
+
+    dev = setup (&fake, EEPROM_SIZE);
+    f = fopen (firmware, "r");
+    if (!f) {
+	perror (firmware);
+	exit (2);
+    }
+    while (fgets (line, sizeof line, f)) {
+	unsigned	len, addr, type, byte, i;
+
+	if (sscanf (line, ":%2x%4x%2x", &len, &addr, &type) != 3)
+	    continue;
+	if (type != 0)
+	    continue;
+	ezusb_fake_peek (fake, EZUSB_FAKE_RAM, addr, ram, len);
+	for (i = 0; i < len; i++) {
+	    if (sscanf (line + 9 + 2 * i, "%2x", &byte) != 1
+		    || ram [i] != byte)
+		ok = 0;
+	}
+	records++;
+    }
+    fclose (f);
+    check (ok && records > 0, "RAM load writes every record");
+
+    ezusb_fake_peek (fake, EZUSB_FAKE_RAM, 0xe600, ram, 1);
+    check ((ram [0] & 1) == 0, "RAM load leaves the CPU running");
+    teardown (dev, fake);
+}
+
+static void check_eeprom (void)
+{
+    struct ezusb	*dev;
+    struct ezusb_fake	*fake;
+    unsigned char	*iic, *dump, eeprom [EEPROM_SIZE];
+    size_t		len, dump_len;
+    unsigned long	writes;
+    unsigned		i;
+    int			status;
+
+    dev = setup (&fake, EEPROM_SIZE);
+    status = ezusb_build_eeprom (dev, firmware, "fx2", 0x08, -1, -1,
+	    tmpfile_path ("boot.iic"));
+    iic = read_file (tmpfile_path ("boot.iic"), &len);
+    check (status == 0 && iic && len > 8 && iic [0] == 0xc2,
+	"boot image builds");
+    if (!iic)
+	exit (2);
+
+    status = ezusb_load_eeprom (dev, firmware, "fx2", 0x08, 0, -1, -1,
+	    EZUSB_EEPROM_VERIFY);
+    ezusb_fake_peek (fake, EZUSB_FAKE_EEPROM, 0, eeprom, sizeof eeprom);
+    check (status == 0 && memcmp (eeprom, iic, len) == 0,
+	"EEPROM write with verify stores the boot image");
+
+    /* besides a write per page, the type byte is written twice; unaligned
+     * writes would cost about one per 16 bytes
+     */
+    writes = ezusb_fake_page_writes (fake);
+    check (writes <= (len + 31) / 32 + 2,
+	"EEPROM writes are page aligned");
+
+    /* an update rewrites only the page that differs */
+    eeprom [len / 2] ^= 0xff;
+    ezusb_fake_poke (fake, EZUSB_FAKE_EEPROM, len / 2, eeprom + len / 2, 1);
+    status = ezusb_load_eeprom (dev, firmware, "fx2", 0x08, 0, -1, -1,
+	    EZUSB_EEPROM_UPDATE | EZUSB_EEPROM_VERIFY);
+    writes = ezusb_fake_page_writes (fake) - writes;
+    ezusb_fake_peek (fake, EZUSB_FAKE_EEPROM, 0, eeprom, sizeof eeprom);
+    check (status == 0 && memcmp (eeprom, iic, len) == 0 && writes <= 3,
+	"EEPROM update repairs just the changed page");
+
+    check (ezusb_eeprom_size (dev, 0) == EEPROM_SIZE,
+	"EEPROM size is detected");
+
+    status = ezusb_dump_eeprom (dev, tmpfile_path ("dump.iic"), 0);
+    dump = read_file (tmpfile_path ("dump.iic"), &dump_len);
+    check (status == 0 && dump && dump_len == len
+	    && memcmp (dump, iic, len) == 0,
+	"EEPROM dump reads back the boot image");
+    free (dump);
+
+    status = ezusb_invalidate_eeprom (dev, 0, 0);
+    ezusb_fake_peek (fake, EZUSB_FAKE_EEPROM, 0, eeprom, sizeof eeprom);
+    check (status == 0 && eeprom [0] != 0xc0 && eeprom [0] != 0xc2
+	    && memcmp (eeprom + 1, iic + 1, len - 1) == 0,
+	"EEPROM invalidate clears just the type byte");
+
+    status = ezusb_erase_eeprom (dev, 0, 0);
+    ezusb_fake_peek (fake, EZUSB_FAKE_EEPROM, 0, eeprom, sizeof eeprom);
+    for (i = 0; i < sizeof eeprom && eeprom [i] == 0xff; i++)
+	continue;
+    check (status == 0 && i == sizeof eeprom, "EEPROM erase blanks the part");
+
+    /* blank parts can't be sized by reading, but reading mustn't write */
+    writes = ezusb_fake_page_writes (fake);
+    status = ezusb_eeprom_size (dev, 0);
+    check (status >= EEPROM_SIZE, "blank EEPROM size is an upper bound");
+    status = ezusb_dump_eeprom (dev, tmpfile_path ("dump.iic"), 0);
+    check (status == 0 && ezusb_fake_page_writes (fake) == writes,
+	"EEPROM size and dump don't write");
+    teardown (dev, fake);
+
+    /* images which don't fit must be refused before anything's written */
+    dev = setup (&fake, 256);
+    status = ezusb_flash_eeprom (dev, tmpfile_path ("boot.iic"), 0, 0);
+    ezusb_fake_peek (fake, EZUSB_FAKE_EEPROM, 0, eeprom, 256);
+    for (i = 0; i < 256 && eeprom [i] == 0xff; i++)
+	continue;
+    check ((len <= 256 || status == -EFBIG) && i == 256,
+	"oversized EEPROM image is refused");
+    teardown (dev, fake);
+
+    free (iic);
+}
+
+/* images too big for the part are refused, but ones that only look
+ * that way (the part holds another copy of the image) are written
+ */
+static void check_eeprom_size (void)
+{
+    struct ezusb	*dev;
+    struct ezusb_fake	*fake;
+    unsigned char	image [EEPROM_SIZE + 4096], eeprom [EEPROM_SIZE];
+    unsigned		i;
+    int			status;
+
+    for (i = 0; i < sizeof image; i++)
+	image [i] = i * 7;
+    image [0] = 0xc2;
+
+    dev = setup (&fake, EEPROM_SIZE);
+    write_file (tmpfile_path ("big.iic"), image, sizeof image);
+    status = ezusb_flash_eeprom (dev, tmpfile_path ("big.iic"), 0, 0);
+    ezusb_fake_peek (fake, EZUSB_FAKE_EEPROM, 0, eeprom, sizeof eeprom);
+    for (i = 0; i < sizeof eeprom && eeprom [i] == 0xff; i++)
+	continue;
+    check (status == -EFBIG && i == sizeof eeprom,
+	"EEPROM image larger than a blank part is refused");
+
+    /* the start of the image repeats at 4 KB */
+    ezusb_fake_poke (fake, EZUSB_FAKE_EEPROM, 0, image, 16);
+    ezusb_fake_poke (fake, EZUSB_FAKE_EEPROM, 4096, image, 16);
+    write_file (tmpfile_path ("big.iic"), image, 6144);
+    status = ezusb_flash_eeprom (dev, tmpfile_path ("big.iic"), 0, 0);
+    ezusb_fake_peek (fake, EZUSB_FAKE_EEPROM, 0, eeprom, sizeof eeprom);
+    check (status == 0 && memcmp (eeprom, image, 6144) == 0,
+	"EEPROM repeating at a power of two isn't taken as its end");
+    teardown (dev, fake);
+}
+
+int main (int argc, char **argv)
+{
+    if (argc != 2) {
+	fprintf (stderr, "usage: %s firmware.hex\n", argv [0]);
+	return 2;
+    }
+    firmware = argv [1];
+    if (!mkdtemp (tmpdir)) {
+	perror ("mkdtemp");
+	return 2;
+    }
+
+    check_ram ();
+    check_eeprom ();
+    check_eeprom_size ();
+
+    unlink (tmpfile_path ("big.iic"));
+    unlink (tmpfile_path ("boot.iic"));
+    unlink (tmpfile_path ("dump.iic"));
+    rmdir (tmpdir);
+    if (failures)
+	printf ("%d checks failed\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,668 @@
+/*
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+/*
+ * The control socket.  Like the hotplug daemon, this forks a child to
+ * do each request, so slow EEPROM writes on one device don't hold up
+ * others, and hexfiles are parsed in the parent so every child shares
+ * them; EEPROM boot images are likewise built there, once, into files
+ * every child flashes.  Requests for the same port are serialized by
+ * usbdev_lock().
+ */
+
+# include  <stdio.h>
+# include  <errno.h>
+# include  <signal.h>
+# include  <stdlib.h>
+# include  <string.h>
+
+# include  <poll.h>
+# include  <fcntl.h>
+# include  <unistd.h>
+# include  <sys/un.h>
+# include  <sys/stat.h>
+# include  <sys/wait.h>
+# include  <sys/socket.h>
+# include  <sys/signalfd.h>
+
+# include "ezusb.h"
+# include "usbdev.h"
+# include "control.h"
+
+extern void logerror(const char *format, ...)
+    __attribute__ ((format (printf, 1, 2)));
+extern int verbose;
+
+#define CONTROL_CLIENTS		64
+#define CONTROL_QUEUE		256
+#define CONTROL_LINE		1024
+
+struct control_client {
+    int			fd;		/* -1 when unused */
+    unsigned		gen;		/* bumped when fd is reused */
+    size_t		len;
+    char		buf [CONTROL_LINE];
+};
+
+struct control_request {
+    unsigned		client, gen;
+    char		line [CONTROL_LINE];
+};
+
+/* a parsed hexfile, reparsed if the file changes */
+struct control_file {
+    char		*path;
+    time_t		mtime;
+    off_t		size;
+    struct ezusb_image	*image;
+    struct control_file	*next;
+};
+
+/* an EEPROM boot image built from a hexfile, rebuilt if it changes */
+struct control_iic {
+    char		*firmware;
+    char		type [8];
+    int			config;
+    time_t		mtime;
+    off_t		size;
+    char		path [256];	/* the built image */
+    struct control_iic	*next;
+};
+
+struct control {
+    struct control_client	clients [CONTROL_CLIENTS];
+    struct control_request	queue [CONTROL_QUEUE];
+    unsigned			head, count;
+    pid_t			*pids;
+    unsigned			jobs, running;
+    struct control_file		*files;
+    struct control_iic		*iics;
+    struct ezusb		*dev;		/* settings and messages */
+};
+
+enum control_opcode { OP_RAM, OP_EEPROM, OP_ERASE, OP_DUMP };
+
+/* one request, pointing into its (tokenized) line */
+struct control_op {
+    enum control_opcode	opcode;
+    const char		*id;
+    const char		*dev, *port;
+    const char		*type;
+    const char		*firmware, *loader, *file;
+    int			config;
+    int			flags;
+    int			large;
+};
+
+/*-------------------------------------------------------------------------*/
+
+static void control_reply (int fd, const char *id, int status)
+{
+    char		buf [256];
+    int			len;
+
+    if (status == 0)
+	len = snprintf (buf, sizeof buf, "ok%s%s\n",
+		id ? " id=" : "", id ? id : "");
+    else
+	len = snprintf (buf, sizeof buf, "error%s%s errno=%d %s\n",
+		id ? " id=" : "", id ? id : "",
+		-status, strerror (-status));
+    if (len >= (int) sizeof buf)
+	len = sizeof buf - 1;
+    send (fd, buf, len, MSG_NOSIGNAL);
+}
+
+static int control_parse (char *line, struct control_op *op)
+{
+    char		*word, *value;
+
+    memset (op, 0, sizeof *op);
+    op->config = -1;
+
+    word = strtok (line, " \t\r");
+    if (!word)
+	return -EINVAL;
+    if (strcmp (word, "ram") == 0)
+	op->opcode = OP_RAM;
+    else if (strcmp (word, "eeprom") == 0)
+	op->opcode = OP_EEPROM;
+    else if (strcmp (word, "erase") == 0)
+	op->opcode = OP_ERASE;
+    else if (strcmp (word, "dump") == 0)
+	op->opcode = OP_DUMP;
+    else
+	return -EOPNOTSUPP;
+
+    while ((word = strtok (NULL, " \t\r")) != 0) {
+	value = strchr (word, '=');
+	if (value)
+	    *value++ = 0;
+
+	if (!value) {
+	    if (strcmp (word, "verify") == 0)
+		op->flags |= EZUSB_EEPROM_VERIFY;
+	    else if (strcmp (word, "update") == 0)
+		op->flags |= EZUSB_EEPROM_UPDATE;
+	    else if (strcmp (word, "used") == 0)
+		op->flags |= EZUSB_EEPROM_ERASE_USED;
+	    else if (strcmp (word, "large") == 0)
+		op->large = 1;
+	    else
+		return -EINVAL;
+	} else if (strcmp (word, "id") == 0)
+	    op->id = value;
+	else if (strcmp (word, "dev") == 0)
+	    op->dev = value;
+	else if (strcmp (word, "port") == 0)
+	    op->port = value;
+	else if (strcmp (word, "type") == 0)
+	    op->type = value;
+	else if (strcmp (word, "firmware") == 0)
+	    op->firmware = value;
+	else if (strcmp (word, "loader") == 0)
+	    op->loader = value;
+	else if (strcmp (word, "file") == 0)
+	    op->file = value;
+	else if (strcmp (word, "config") == 0) {
+	    op->config = strtoul (value, 0, 0);
+	    if (op->config < 0 || op->config > 255)
+		return -EINVAL;
+	} else
+	    return -EINVAL;
+    }
+
+    if ((!op->dev == !op->port) || !op->type)
+	return -EINVAL;
+    if (strcmp (op->type, "an21") && strcmp (op->type, "fx")
+	    && strcmp (op->type, "fx2") && strcmp (op->type, "fx2lp"))
+	return -EINVAL;
+    switch (op->opcode) {
+    case OP_RAM:
+	if (!op->firmware)
+	    return -EINVAL;
+	break;
+    case OP_EEPROM:
+	if (!op->loader || !op->firmware || op->config < 0)
+	    return -EINVAL;
+	break;
+    case OP_ERASE:
+	if (!op->loader)
+	    return -EINVAL;
+	break;
+    case OP_DUMP:
+	if (!op->loader || !op->file)
+	    return -EINVAL;
+	break;
+    }
+    return 0;
+}
+
+/* returns the parsed hexfile, parsing it unless that's already done */
+static struct ezusb_image *control_image (struct control *c,
+	const char *path)
+{
+    struct control_file	*f;
+    struct stat		st;
+
+    if (stat (path, &st) < 0)
+	return NULL;
+    for (f = c->files; f; f = f->next) {
+	if (strcmp (f->path, path) == 0)
+	    break;
+    }
+    if (f && f->mtime == st.st_mtime && f->size == st.st_size)
+	return f->image;
+
+    if (!f) {
+	f = calloc (1, sizeof *f);
+	if (!f || !(f->path = strdup (path))) {
+	    free (f);
+	    return NULL;
+	}
+	f->next = c->files;
+	c->files = f;
+    }
+    ezusb_image_free (f->image);
+    f->image = ezusb_image_read (c->dev, path);
+    f->mtime = st.st_mtime;
+    f->size = st.st_size;
+    return f->image;
+}
+
+/*
+ * Returns the EEPROM boot image for the hexfile, type and config byte,
+ * building it unless that's already done; the children just flash it,
+ * so none of them reparses the hexfile or lays out the image.
+ */
+static const char *control_iic (struct control *c, const struct control_op *op)
+{
+    struct control_iic	*i;
+    struct stat		st;
+    const char		*tmp = getenv ("TMPDIR");
+    int			fd;
+
+    if (stat (op->firmware, &st) < 0)
+	return NULL;
+    for (i = c->iics; i; i = i->next) {
+	if (strcmp (i->firmware, op->firmware) == 0
+		&& strcmp (i->type, op->type) == 0
+		&& i->config == op->config)
+	    break;
+    }
+    if (i && i->path [0] && i->mtime == st.st_mtime
+	    && i->size == st.st_size)
+	return i->path;
+
+    if (!i) {
+	i = calloc (1, sizeof *i);
+	if (!i || !(i->firmware = strdup (op->firmware))) {
+	    free (i);
+	    return NULL;
+	}
+	snprintf (i->type, sizeof i->type, "%s", op->type);
+	i->config = op->config;
+	i->next = c->iics;
+	c->iics = i;
+    }
+    if (!i->path [0]) {
+	snprintf (i->path, sizeof i->path, "%s/fxload-XXXXXX",
+		tmp ? tmp : "/tmp");
+	fd = mkstemp (i->path);
+	if (fd < 0) {
+	    i->path [0] = 0;
+	    return NULL;
+	}
+	close (fd);
+    }
+    if (ezusb_build_eeprom (c->dev, op->firmware, op->type, op->config,
+		-1, -1, i->path) != 0) {
+	unlink (i->path);
+	i->path [0] = 0;
+	return NULL;
+    }
+    i->mtime = st.st_mtime;
+    i->size = st.st_size;
+    return i->path;
+}
+
+/* usbdev_scan() callback, for requests naming a port */
+static int control_port (const struct usbdev *dev, void *context)
+{
+    snprintf (context, sizeof ((struct usbdev *) 0)->path, "%s", dev->path);
+    return 1;
+}
+
+/* runs in the child */
+static int control_run (
+    struct ezusb		*dev,
+    const struct control_op	*op,
+    const struct ezusb_image	*firmware,
+    const struct ezusb_image	*loader,
+    const char			*iic
+) {
+    char			path [sizeof ((struct usbdev *) 0)->path];
+    long long			waited;
+    int				lock, fx2, status;
+
+    if (op->port) {
+	struct usbdev_match	match = { -1, -1, op->port, 0 };
+
+	path [0] = 0;
+	if (usbdev_scan (&match, control_port, path) < 0 || !path [0])
+	    return -ENODEV;
+    } else
+	snprintf (path, sizeof path, "%s", op->dev);
+
+    lock = usbdev_lock (path, &waited);
+    if (lock < 0)
+	return lock;
+    status = ezusb_open (dev, path);
+    if (status < 0) {
+	close (lock);
+	return status;
+    }
+
+    if (strcmp (op->type, "fx2lp") == 0)
+	fx2 = 2;
+    else
+	fx2 = (strcmp (op->type, "fx2") == 0);
+
+    status = 0;
+    if (loader)
+	status = ezusb_load_image (dev, loader, fx2, 0);
+    if (status == 0) {
+	switch (op->opcode) {
+	case OP_RAM:
+	    status = ezusb_load_image (dev, firmware, fx2, loader ? 1 : 0);
+	    break;
+	case OP_EEPROM:
+	    status = ezusb_flash_eeprom (dev, iic, op->large, op->flags);
+	    break;
+	case OP_ERASE:
+	    status = ezusb_erase_eeprom (dev, op->large, op->flags);
+	    break;
+	case OP_DUMP:
+	    status = ezusb_dump_eeprom (dev, op->file, op->large);
+	    break;
+	}
+    }
+    ezusb_close (dev);
+    close (lock);
+
+    /* a few paths just say -1 */
+    return (status < 0 && status != -1) ? status : (status ? -EIO : 0);
+}
+
+/* starts a queued request, unless its client went away */
+static void control_start (struct control *c, struct control_request *r,
+	const sigset_t *mask)
+{
+    struct control_client	*client = &c->clients [r->client];
+    struct control_op		op;
+    struct ezusb_image		*firmware = NULL, *loader = NULL;
+    const char			*iic = NULL;
+    unsigned			i;
+    int				status;
+    pid_t			pid;
+
+    if (client->fd < 0 || client->gen != r->gen)
+	return;
+
+    status = control_parse (r->line, &op);
+    if (status == 0 && op.loader && !(loader = control_image (c, op.loader)))
+	status = -ENOENT;
+    if (status == 0 && op.opcode == OP_RAM
+	    && !(firmware = control_image (c, op.firmware)))
+	status = -ENOENT;
+    if (status == 0 && op.opcode == OP_EEPROM && !(iic = control_iic (c, &op)))
+	status = -ENOENT;
+    if (status < 0) {
+	control_reply (client->fd, op.id, status);
+	return;
+    }
+
+    pid = fork ();
+    if (pid == 0) {
+	sigprocmask (SIG_UNBLOCK, mask, NULL);
+	status = control_run (c->dev, &op, firmware, loader, iic);
+	control_reply (client->fd, op.id, status);
+	_exit (status ? 1 : 0);
+    }
+    if (pid < 0) {
+	control_reply (client->fd, op.id, -errno);
+	return;
+    }
+    for (i = 0; c->pids [i]; i++)
+	continue;
+    c->pids [i] = pid;
+    c->running++;
+}
+
+static void control_enqueue (struct control *c, unsigned client,
+	const char *line)
+{
+    struct control_request	*r;
+
+    if (c->count == CONTROL_QUEUE) {
+	control_reply (c->clients [client].fd, NULL, -EBUSY);
+	return;
+    }
+    r = &c->queue [(c->head + c->count) % CONTROL_QUEUE];
+    r->client = client;
+    r->gen = c->clients [client].gen;
+    snprintf (r->line, sizeof r->line, "%s", line);
+    c->count++;
+}
+
+static void control_close (struct control_client *client)
+{
+    close (client->fd);
+    client->fd = -1;
+    client->gen++;
+    client->len = 0;
+}
+
+/* reads what a client sent, queueing each complete line */
+static void control_read (struct control *c, unsigned i)
+{
+    struct control_client	*client = &c->clients [i];
+    char			*start, *nl;
+    ssize_t			len;
+
+    len = recv (client->fd, client->buf + client->len,
+	    sizeof client->buf - client->len - 1, MSG_DONTWAIT);
+    if (len <= 0) {
+	if (len == 0 || (errno != EAGAIN && errno != EINTR))
+	    control_close (client);
+	return;
+    }
+    client->len += len;
+    client->buf [client->len] = 0;
+
+    for (start = client->buf; (nl = strchr (start, '\n')) != 0;
+	    start = nl + 1) {
+	*nl = 0;
+	if (*start)
+	    control_enqueue (c, i, start);
+    }
+    client->len -= start - client->buf;
+    memmove (client->buf, start, client->len);
+
+    /* lines can't be longer than the buffer */
+    if (client->len == sizeof client->buf - 1) {
+	control_reply (client->fd, NULL, -E2BIG);
+	client->len = 0;
+    }
+}
+
+static void control_accept (struct control *c, int listener)
+{
+    unsigned		i;
+    int			fd;
+
+    fd = accept (listener, NULL, NULL);
+    if (fd < 0)
+	return;
+    fcntl (fd, F_SETFD, FD_CLOEXEC);
+    fcntl (fd, F_SETFL, O_NONBLOCK);
+    for (i = 0; i < CONTROL_CLIENTS; i++) {
+	if (c->clients [i].fd < 0) {
+	    c->clients [i].fd = fd;
+	    c->clients [i].len = 0;
+	    return;
+	}
+    }
+    control_reply (fd, NULL, -EMFILE);
+    close (fd);
+}
+
+static void control_reap (struct control *c)
+{
+    pid_t		pid;
+    unsigned		i;
+
+    while ((pid = waitpid (-1, NULL, WNOHANG)) > 0) {
+	for (i = 0; i < c->jobs; i++) {
+	    if (c->pids [i] == pid) {
+		c->pids [i] = 0;
+		c->running--;
+	    }
+	}
+    }
+}
+
+/*
+ * Only root may connect:  requests name files the daemon will write.
+ * An old socket is replaced, but nothing else that's in the way.
+ */
+static int control_listen (const char *path)
+{
+    struct sockaddr_un	addr;
+    struct stat		st;
+    mode_t		mask;
+    int			fd, status;
+
+    memset (&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen (path) >= sizeof addr.sun_path)
+	return -ENAMETOOLONG;
+    strcpy (addr.sun_path, path);
+
+    fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+	return -errno;
+    if (lstat (path, &st) == 0) {
+	if (!S_ISSOCK (st.st_mode)) {
+	    close (fd);
+	    return -EEXIST;
+	}
+	unlink (path);
+    }
+    mask = umask (0177);
+    status = bind (fd, (struct sockaddr *) &addr, sizeof addr);
+    umask (mask);
+    if (status < 0 || chmod (path, 0600) < 0 || listen (fd, 16) < 0) {
+	status = -errno;
+	close (fd);
+	return status;
+    }
+    return fd;
+}
+
+int fxload_control (const char *path, unsigned jobs, struct ezusb *dev)
+{
+    struct control		*c;
+    struct pollfd		fds [2 + CONTROL_CLIENTS];
+    unsigned			map [CONTROL_CLIENTS];
+    struct control_file		*f;
+    struct control_iic		*iic;
+    sigset_t			mask;
+    unsigned			i, n;
+    int				listener, sfd, status = 0;
+
+    c = calloc (1, sizeof *c);
+    if (!c)
+	return -ENOMEM;
+    c->jobs = jobs ? jobs : 1;
+    c->dev = dev;
+    c->pids = calloc (c->jobs, sizeof *c->pids);
+    if (!c->pids) {
+	free (c);
+	return -ENOMEM;
+    }
+    for (i = 0; i < CONTROL_CLIENTS; i++)
+	c->clients [i].fd = -1;
+
+    listener = control_listen (path);
+    if (listener < 0) {
+	logerror("%s: can't listen, %s\n", path, strerror (-listener));
+	status = listener;
+	goto done;
+    }
+
+    sigemptyset (&mask);
+    sigaddset (&mask, SIGCHLD);
+    sigaddset (&mask, SIGINT);
+    sigaddset (&mask, SIGTERM);
+    sigprocmask (SIG_BLOCK, &mask, NULL);
+    sfd = signalfd (-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (sfd < 0) {
+	status = -errno;
+	logerror("can't set up signals: %s\n", strerror (errno));
+	close (listener);
+	goto done;
+    }
+
+    if (verbose)
+	logerror("listening on %s, %u requests at a time\n", path, c->jobs);
+
+    for (;;) {
+	struct signalfd_siginfo	info;
+	int			stop = 0;
+
+	fds [0].fd = listener;
+	fds [0].events = POLLIN;
+	fds [1].fd = sfd;
+	fds [1].events = POLLIN;
+	for (i = 0, n = 2; i < CONTROL_CLIENTS; i++) {
+	    if (c->clients [i].fd < 0)
+		continue;
+	    fds [n].fd = c->clients [i].fd;
+	    fds [n].events = POLLIN;
+	    map [n - 2] = i;
+	    n++;
+	}
+
+	if (poll (fds, n, -1) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    status = -errno;
+	    break;
+	}
+	for (i = 2; i < n; i++) {
+	    if (fds [i].revents)
+		control_read (c, map [i - 2]);
+	}
+	if (fds [0].revents)
+	    control_accept (c, listener);
+	while (read (sfd, &info, sizeof info) == sizeof info) {
+	    if (info.ssi_signo != SIGCHLD)
+		stop = 1;
+	}
+	control_reap (c);
+	if (stop)
+	    break;
+
+	while (c->count && c->running < c->jobs) {
+	    struct control_request	*r = &c->queue [c->head];
+
+	    c->head = (c->head + 1) % CONTROL_QUEUE;
+	    c->count--;
+	    control_start (c, r, &mask);
+	}
+    }
+
+    /* let requests already underway finish */
+    while (c->running > 0 && wait (NULL) > 0)
+	c->running--;
+    close (sfd);
+    close (listener);
+    unlink (path);
+    sigprocmask (SIG_UNBLOCK, &mask, NULL);
+done:
+    for (i = 0; i < CONTROL_CLIENTS; i++) {
+	if (c->clients [i].fd >= 0)
+	    close (c->clients [i].fd);
+    }
+    while ((f = c->files) != 0) {
+	c->files = f->next;
+	ezusb_image_free (f->image);
+	free (f->path);
+	free (f);
+    }
+    while ((iic = c->iics) != 0) {
+	c->iics = iic->next;
+	if (iic->path [0])
+	    unlink (iic->path);
+	free (iic->firmware);
+	free (iic);
+    }
+    free (c->pids);
+    free (c);
+    return status;
+}
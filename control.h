@@ -0,0 +1,47 @@
+#ifndef __control_H
+#define __control_H
+/*
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+struct ezusb;
+
+/*
+ * Serves requests on a Unix domain socket, so scripts and test rigs
+ * can load firmware without starting fxload (and parsing its messages)
+ * each time.  Each request is a line, "op key=value ...":
+ *
+ *	ram	dev=PATH|port=PORT type=T firmware=HEX [loader=HEX]
+ *	eeprom	dev=|port= type=T loader=HEX firmware=HEX config=N
+ *			[verify] [update] [large]
+ *	erase	dev=|port= type=T loader=HEX [used] [large]
+ *	dump	dev=|port= type=T loader=HEX file=PATH [large]
+ *
+ * Any request may carry "id=TAG".  Each gets one line back:
+ * "ok [id=TAG]" or "error [id=TAG] errno=N message".  Requests run
+ * concurrently, at most "jobs" at once, except that those for the same
+ * port take turns; replies may come back out of order.  Hexfiles are
+ * parsed (and EEPROM images built) once and shared by all requests,
+ * until they change.  The socket is mode 0600, so only its owner may
+ * connect; an existing file that isn't a socket isn't replaced.
+ *
+ * Loads use the library context's settings and log function.  Returns
+ * when SIGINT or SIGTERM arrives; zero, else negative errno.
+ */
+extern int fxload_control (const char *path, unsigned jobs,
+	struct ezusb *dev);
+
+#endif
@@ -0,0 +1,383 @@
+/*
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+/*
+ * A resident loader.  Running fxload from hotplug scripts pays for
+ * exec, dynamic linking, and hexfile parsing for every device; when
+ * dozens of devices enumerate at boot, that's a storm of processes all
+ * parsing the same files.  Instead this listens to kernel uevents on a
+ * netlink socket (no udev needed), and forks one child per new device,
+ * a bounded number at a time.  Children inherit whatever the parent
+ * already parsed.
+ *
+ * Devices which enumerated before the daemon started (early boot, or a
+ * restart) get no uevent, so sysfs is scanned once at startup, after
+ * the socket is listening, and those are loaded the same way.
+ *
+ * Waiting devices aren't handled in arrival order:  each may have a
+ * priority and deadline, so (say) boot-critical audio interfaces get
+ * loaded before diagnostic boards, and loads are spread across buses
+ * instead of saturating one.  The queue is small, so picking the next
+ * device is just a scan of it.
+ */
+
+# include  <stdio.h>
+# include  <errno.h>
+# include  <signal.h>
+# include  <stdlib.h>
+# include  <string.h>
+
+# include  <poll.h>
+# include  <unistd.h>
+# include  <sys/wait.h>
+# include  <sys/signalfd.h>
+
+# include "ezusb.h"
+# include "daemon.h"
+
+extern void logerror(const char *format, ...)
+    __attribute__ ((format (printf, 1, 2)));
+extern int verbose;
+
+/* devices waiting for a free job slot */
+#define DAEMON_QUEUE		256
+
+/* how long to wait for the kernel to create a device node */
+#define DAEMON_NODE_WAIT	100		/* times 10 msec */
+
+struct daemon_item {
+    struct usbdev	dev;
+    struct daemon_sched	sched;
+    unsigned		seq;		/* arrival order */
+    long long		added;		/* usbdev_boottime() */
+};
+
+struct daemon_job {
+    pid_t		pid;
+    struct daemon_item	item;
+};
+
+struct daemon {
+    int			(*accept) (const struct usbdev *dev,
+				struct daemon_sched *sched);
+    int			(*load) (const struct usbdev *dev);
+    const struct usbdev_match	*match;
+
+    struct daemon_item	queue [DAEMON_QUEUE];
+    unsigned		count, seq;
+
+    struct daemon_job	*jobs;
+    unsigned		njobs, running, per_bus;
+
+    unsigned		loaded, missed;
+};
+
+static void daemon_enqueue (struct daemon *d, const struct usbdev *dev)
+{
+    struct daemon_item	*item;
+    struct daemon_sched	sched = { 0, 0 };
+    unsigned		i;
+
+    /* a device that appears during the coldplug scan shows up twice */
+    for (i = 0; i < d->count; i++) {
+	if (!strcmp (d->queue [i].dev.path, dev->path))
+	    return;
+    }
+    for (i = 0; i < d->njobs; i++) {
+	if (d->jobs [i].pid && !strcmp (d->jobs [i].item.dev.path, dev->path))
+	    return;
+    }
+
+    if (d->accept && d->accept (dev, &sched) != 0)
+	return;
+
+    if (d->count == DAEMON_QUEUE) {
+	logerror("%s: too many devices waiting, ignored\n", dev->path);
+	return;
+    }
+    item = &d->queue [d->count++];
+    item->dev = *dev;
+    item->sched = sched;
+    item->seq = d->seq++;
+    item->added = usbdev_boottime ();
+}
+
+/* nonzero if a should be loaded before b */
+static int daemon_before (const struct daemon_item *a,
+	const struct daemon_item *b)
+{
+    if (a->sched.priority != b->sched.priority)
+	return a->sched.priority > b->sched.priority;
+    if (a->sched.deadline && b->sched.deadline) {
+	long long	due_a = a->added + a->sched.deadline;
+	long long	due_b = b->added + b->sched.deadline;
+
+	if (due_a != due_b)
+	    return due_a < due_b;
+    } else if (a->sched.deadline || b->sched.deadline)
+	return a->sched.deadline != 0;
+    return (int) (a->seq - b->seq) < 0;
+}
+
+/* how many loads are running on this bus */
+static unsigned daemon_bus_load (struct daemon *d, unsigned busnum)
+{
+    unsigned		i, n = 0;
+
+    for (i = 0; i < d->njobs; i++) {
+	if (d->jobs [i].pid && d->jobs [i].item.dev.busnum == busnum)
+	    n++;
+    }
+    return n;
+}
+
+/* picks the next device to load, or returns -1 if none may start now */
+static int daemon_next (struct daemon *d)
+{
+    unsigned		i;
+    int			best = -1;
+
+    for (i = 0; i < d->count; i++) {
+	const struct daemon_item	*item = &d->queue [i];
+
+	if (best >= 0 && !daemon_before (item, &d->queue [best]))
+	    continue;
+	if (d->per_bus && daemon_bus_load (d, item->dev.busnum) >= d->per_bus)
+	    continue;
+	best = i;
+    }
+    return best;
+}
+
+/* usbdev_scan() callback */
+static int daemon_coldplug (const struct usbdev *dev, void *context)
+{
+    daemon_enqueue (context, dev);
+    return 0;
+}
+
+/* runs in the child */
+static int daemon_load (struct daemon *d, const struct usbdev *dev)
+{
+    unsigned		tries;
+
+    /* devtmpfs normally has the node before the uevent goes out */
+    for (tries = 0; access (dev->path, F_OK) != 0; tries++) {
+	if (tries == DAEMON_NODE_WAIT) {
+	    logerror("%s: no device node\n", dev->path);
+	    return -1;
+	}
+	usleep (10 * 1000);
+    }
+    return d->load (dev);
+}
+
+static void daemon_start (struct daemon *d, const sigset_t *mask)
+{
+    while (d->count && d->running < d->njobs) {
+	struct daemon_job	*job;
+	unsigned		i;
+	int			next;
+
+	next = daemon_next (d);
+	if (next < 0)
+	    break;
+
+	for (i = 0; d->jobs [i].pid; i++)
+	    continue;
+	job = &d->jobs [i];
+	job->item = d->queue [next];
+	d->queue [next] = d->queue [--d->count];
+
+	if (verbose)
+	    logerror("%s: port %s, %04x:%04x, priority %d, waited %lld ms\n",
+		job->item.dev.path, job->item.dev.name,
+		job->item.dev.vid, job->item.dev.pid,
+		job->item.sched.priority,
+		usbdev_boottime () - job->item.added);
+
+	job->pid = fork ();
+	if (job->pid == 0) {
+	    sigprocmask (SIG_UNBLOCK, mask, NULL);
+	    _exit (daemon_load (d, &job->item.dev) ? 1 : 0);
+	}
+	if (job->pid < 0) {
+	    logerror("%s: can't fork, %s\n", job->item.dev.path,
+		strerror (errno));
+	    job->pid = 0;
+	    continue;
+	}
+	d->running++;
+    }
+}
+
+/* a load finished; was the device ready in time? */
+static void daemon_done (struct daemon *d, struct daemon_job *job, int status)
+{
+    const struct daemon_item	*item = &job->item;
+    long long			elapsed;
+
+    job->pid = 0;
+    d->running--;
+
+    if (!WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+	logerror("%s: port %s, load failed\n", item->dev.path, item->dev.name);
+	return;
+    }
+    d->loaded++;
+    elapsed = usbdev_boottime () - item->added;
+    if (item->sched.deadline && elapsed > item->sched.deadline) {
+	d->missed++;
+	logerror("%s: port %s, ready after %lld ms, missed its %u ms deadline\n",
+	    item->dev.path, item->dev.name, elapsed, item->sched.deadline);
+    } else if (verbose)
+	logerror("%s: port %s, ready after %lld ms\n",
+	    item->dev.path, item->dev.name, elapsed);
+}
+
+static void daemon_reap (struct daemon *d)
+{
+    pid_t		pid;
+    int			status;
+    unsigned		i;
+
+    while ((pid = waitpid (-1, &status, WNOHANG)) > 0) {
+	for (i = 0; i < d->njobs && d->jobs [i].pid != pid; i++)
+	    continue;
+	if (i < d->njobs)
+	    daemon_done (d, &d->jobs [i], status);
+    }
+}
+
+/* handles whatever uevents are waiting */
+static void daemon_uevents (struct daemon *d, int fd)
+{
+    struct usbdev	dev;
+    int			status;
+
+    while ((status = usbdev_monitor_read (fd, &dev)) != -EAGAIN) {
+	if (status == -ENOBUFS)
+	    logerror("uevents were lost\n");
+	else if (status < 0)
+	    return;
+	else if (status == USBDEV_ADD && usbdev_match (&dev, d->match))
+	    daemon_enqueue (d, &dev);
+    }
+}
+
+int fxload_daemon (const struct usbdev_match *match,
+	unsigned jobs, unsigned per_bus,
+	int (*accept) (const struct usbdev *dev, struct daemon_sched *sched),
+	int (*load) (const struct usbdev *dev))
+{
+    struct daemon	d;
+    struct pollfd	fds [2];
+    sigset_t		mask;
+    int			status = 0;
+
+    memset (&d, 0, sizeof d);
+    d.accept = accept;
+    d.load = load;
+    d.match = match;
+    d.njobs = jobs ? jobs : 1;
+    d.per_bus = per_bus;
+    d.jobs = calloc (d.njobs, sizeof *d.jobs);
+    if (!d.jobs)
+	return -ENOMEM;
+
+    fds [0].fd = usbdev_monitor ();
+    if (fds [0].fd < 0) {
+	logerror("can't listen for uevents: %s\n", strerror (-fds [0].fd));
+	free (d.jobs);
+	return fds [0].fd;
+    }
+    fds [0].events = POLLIN;
+
+    /* child exits and shutdown requests come in through a signalfd */
+    sigemptyset (&mask);
+    sigaddset (&mask, SIGCHLD);
+    sigaddset (&mask, SIGINT);
+    sigaddset (&mask, SIGTERM);
+    sigprocmask (SIG_BLOCK, &mask, NULL);
+    fds [1].fd = signalfd (-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (fds [1].fd < 0) {
+	status = -errno;
+	logerror("can't set up signals: %s\n", strerror (errno));
+	goto done;
+    }
+    fds [1].events = POLLIN;
+
+    /* coldplug:  devices that showed up before we were listening.
+     * Anything added from now on also gets a uevent.
+     */
+    status = usbdev_scan (match, daemon_coldplug, &d);
+    if (status < 0)
+	logerror("can't scan USB devices: %s\n", strerror (-status));
+    else if (verbose)
+	logerror("%d devices already present\n", status);
+    status = 0;
+    daemon_start (&d, &mask);
+
+    if (verbose)
+	logerror("waiting for devices, %u at a time\n", d.njobs);
+
+    for (;;) {
+	struct signalfd_siginfo	info;
+	int			stop = 0;
+
+	if (poll (fds, 2, -1) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    status = -errno;
+	    break;
+	}
+	if (fds [0].revents)
+	    daemon_uevents (&d, fds [0].fd);
+	while (read (fds [1].fd, &info, sizeof info) == sizeof info) {
+	    if (info.ssi_signo != SIGCHLD)
+		stop = 1;
+	}
+	daemon_reap (&d);
+	if (stop)
+	    break;
+	daemon_start (&d, &mask);
+    }
+
+    /* let loads already underway finish */
+    while (d.running > 0) {
+	pid_t		pid;
+	unsigned	i;
+	int		wstatus;
+
+	pid = wait (&wstatus);
+	if (pid < 0)
+	    break;
+	for (i = 0; i < d.njobs; i++) {
+	    if (d.jobs [i].pid == pid)
+		daemon_done (&d, &d.jobs [i], wstatus);
+	}
+    }
+    if (d.missed || verbose)
+	logerror("%u devices loaded, %u missed deadlines\n",
+	    d.loaded, d.missed);
+    close (fds [1].fd);
+done:
+    close (fds [0].fd);
+    sigprocmask (SIG_UNBLOCK, &mask, NULL);
+    free (d.jobs);
+    return status;
+}
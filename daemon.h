@@ -0,0 +1,50 @@
+#ifndef __daemon_H
+#define __daemon_H
+/*
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+#include "usbdev.h"
+
+/*
+ * How urgently a device needs loading.  Higher priorities go first,
+ * then earlier deadlines, then whichever appeared first.  A deadline
+ * (milliseconds after the device appeared, zero for none) doesn't
+ * preempt anything; missing it just gets reported.
+ */
+struct daemon_sched {
+    int			priority;
+    unsigned		deadline;
+};
+
+/*
+ * Stays resident, listening for kernel uevents, and calls load() in a
+ * child process for each matching USB device that's added, with at most
+ * "jobs" loads running at once, and at most "per_bus" (unless zero) on
+ * any one bus.  Matching devices already present when it starts are
+ * loaded first.  Anything the loads need (such as parsed firmware)
+ * should be set up beforehand, so children inherit it; if accept() is
+ * given, it's called in the daemon itself before a device is queued,
+ * and can do that and set its scheduling, or refuse the device by
+ * returning nonzero.  Returns when SIGINT or SIGTERM arrives; zero,
+ * else negative errno.
+ */
+extern int fxload_daemon (const struct usbdev_match *match,
+	unsigned jobs, unsigned per_bus,
+	int (*accept) (const struct usbdev *dev, struct daemon_sched *sched),
+	int (*load) (const struct usbdev *dev));
+
+#endif
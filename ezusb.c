@@ -23,9 +23,14 @@
 # include  <errno.h>
 # include  <assert.h>
 # include  <limits.h>
+# include  <stdarg.h>
 # include  <stdlib.h>
 # include  <string.h>
 
+# include  <poll.h>
+# include  <fcntl.h>
+# include  <unistd.h>
+# include  <time.h>
 # include  <sys/ioctl.h>
 
 # include  <linux/version.h>
@@ -34,9 +39,6 @@
 
 # include "ezusb.h"
 
-extern void logerror(const char *format, ...)
-    __attribute__ ((format (printf, 1, 2)));
-
 /*
  * This file contains functions for downloading firmware into Cypress
  * EZ-USB microcontrollers. These chips use control endpoint 0 and vendor
@@ -56,7 +58,235 @@ extern void logerror(const char *format, ...)
  * The Cypress FX parts are largely compatible with the Anchorhip ones.
  */
 
-int verbose;
+/*
+ * Everything a download needs to know besides its arguments lives in
+ * the context, never in globals, so separate contexts can be used by
+ * separate threads at once.
+ */
+#define STRAY_MAX	8
+
+struct ezusb {
+    int			fd;		/* usbfs device, or -1 */
+    int			own_fd;		/* close it when done */
+    const struct ezusb_transport *transport;
+    void		*transport_arg;
+
+    void		(*log) (void *arg, const char *message);
+    void		*log_arg;
+    int			verbose;
+
+    unsigned		timeout;	/* msec, per control request */
+    int			page_size;	/* EEPROM page size, or zero */
+    unsigned		merge_gap;
+    char		*journal;
+
+    struct ezusb_stats	stats;
+
+    /* URBs a synchronous request reaped while waiting for its own */
+    struct usbdevfs_urb	*stray [STRAY_MAX];
+    unsigned		nstray;
+
+    void		(*progress) (void *arg, int phase,
+				unsigned long done, unsigned long total);
+    void		*progress_arg;
+    int			progress_phase;	/* zero when not reporting */
+    unsigned long	progress_done, progress_total;
+    long long		progress_next;	/* msec */
+};
+
+struct ezusb *ezusb_new (void)
+{
+    struct ezusb	*dev = calloc (1, sizeof *dev);
+
+    if (!dev)
+	return NULL;
+    dev->fd = -1;
+    dev->timeout = 10000;
+    dev->transport = &ezusb_usbfs_transport;
+    return dev;
+}
+
+void ezusb_close (struct ezusb *dev)
+{
+    if (dev->own_fd && dev->fd >= 0)
+	close (dev->fd);
+    dev->fd = -1;
+    dev->own_fd = 0;
+    dev->nstray = 0;
+}
+
+void ezusb_free (struct ezusb *dev)
+{
+    if (!dev)
+	return;
+    ezusb_close (dev);
+    free (dev->journal);
+    free (dev);
+}
+
+int ezusb_open (struct ezusb *dev, const char *path)
+{
+    int			fd;
+
+    fd = open (path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+	return -errno;
+    ezusb_close (dev);
+    dev->fd = fd;
+    dev->own_fd = 1;
+    return 0;
+}
+
+void ezusb_set_fd (struct ezusb *dev, int fd)
+{
+    ezusb_close (dev);
+    dev->fd = fd;
+}
+
+int ezusb_fd (const struct ezusb *dev)
+{
+    return dev->fd;
+}
+
+void ezusb_set_transport (struct ezusb *dev,
+	const struct ezusb_transport *transport, void *arg)
+{
+    dev->transport = transport ? transport : &ezusb_usbfs_transport;
+    dev->transport_arg = arg;
+}
+
+void ezusb_get_transport (const struct ezusb *dev,
+	const struct ezusb_transport **transport, void **arg)
+{
+    *transport = dev->transport;
+    *arg = dev->transport_arg;
+}
+
+void ezusb_set_log (struct ezusb *dev,
+	void (*log) (void *arg, const char *message), void *arg)
+{
+    dev->log = log;
+    dev->log_arg = arg;
+}
+
+void ezusb_set_verbose (struct ezusb *dev, int level)
+{
+    dev->verbose = level;
+}
+
+void ezusb_set_timeout (struct ezusb *dev, unsigned msec)
+{
+    dev->timeout = msec;
+}
+
+void ezusb_set_page_size (struct ezusb *dev, int page_size)
+{
+    dev->page_size = page_size;
+}
+
+void ezusb_set_merge_gap (struct ezusb *dev, unsigned gap)
+{
+    dev->merge_gap = (gap > EZUSB_MERGE_GAP_MAX) ? EZUSB_MERGE_GAP_MAX : gap;
+}
+
+int ezusb_set_journal (struct ezusb *dev, const char *path)
+{
+    char		*copy = NULL;
+
+    if (path && !(copy = strdup (path)))
+	return -ENOMEM;
+    free (dev->journal);
+    dev->journal = copy;
+    return 0;
+}
+
+void ezusb_get_stats (const struct ezusb *dev, struct ezusb_stats *stats)
+{
+    *stats = dev->stats;
+}
+
+void ezusb_set_progress (struct ezusb *dev,
+	void (*progress) (void *arg, int phase,
+		unsigned long done, unsigned long total),
+	void *arg)
+{
+    dev->progress = progress;
+    dev->progress_arg = arg;
+    dev->progress_phase = 0;
+}
+
+/* messages go to the context's log function, else stderr */
+static void ezusb_log (struct ezusb *dev, const char *format, ...)
+    __attribute__ ((format (printf, 2, 3)));
+
+static void ezusb_log (struct ezusb *dev, const char *format, ...)
+{
+    char		buf [1024];
+    va_list		ap;
+
+    va_start (ap, format);
+    vsnprintf (buf, sizeof buf, format, ap);
+    va_end (ap);
+    if (dev && dev->log)
+	dev->log (dev->log_arg, buf);
+    else
+	fputs (buf, stderr);
+}
+
+static long long ezusb_msec (void)
+{
+    struct timespec	ts;
+
+    clock_gettime (CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Progress reports go out when a phase begins and ends, and otherwise
+ * at most every PROGRESS_INTERVAL msec however many transfers there
+ * are.  Without a progress function no phase ever begins, so each
+ * transfer only pays for one comparison.
+ */
+#define PROGRESS_INTERVAL	100
+
+static void progress_begin (struct ezusb *dev, int phase, unsigned long total)
+{
+    if (!dev->progress)
+	return;
+    dev->progress_phase = phase;
+    dev->progress_done = 0;
+    dev->progress_total = total;
+    dev->progress_next = ezusb_msec () + PROGRESS_INTERVAL;
+    dev->progress (dev->progress_arg, phase, 0, total);
+}
+
+static inline void progress_add (struct ezusb *dev, int phase, unsigned long n)
+{
+    long long		now;
+
+    if (dev->progress_phase != phase)
+	return;
+    dev->progress_done += n;
+    if (dev->progress_done > dev->progress_total)
+	dev->progress_done = dev->progress_total;
+    now = ezusb_msec ();
+    if (now < dev->progress_next)
+	return;
+    dev->progress_next = now + PROGRESS_INTERVAL;
+    dev->progress (dev->progress_arg, phase,
+	    dev->progress_done, dev->progress_total);
+}
+
+/* done; pages which needed no rewriting, and the like, count too */
+static void progress_end (struct ezusb *dev, int phase)
+{
+    if (dev->progress_phase != phase)
+	return;
+    dev->progress_phase = 0;
+    dev->progress (dev->progress_arg, phase,
+	    dev->progress_total, dev->progress_total);
+}
+
 
 /*
  * return true iff [addr,addr+len) includes external RAM
@@ -130,11 +360,153 @@ static int fx2lp_is_external (unsigned short addr, size_t len)
 #endif
 
 /*
- * Issue a control request to the specified device.
- * This is O/S specific ...
+ * The usbfs transports.  The usual one has the kernel do the whole
+ * control transfer; the other queues it as a URB and waits, the way
+ * libusb does, so the two can be compared.  Both let URBs be queued
+ * directly, for pipelined EEPROM reads and asynchronous loads.
+ */
+static int usbfs_control (struct ezusb *dev, void *arg,
+	const struct ezusb_ctrl *req)
+{
+    struct usbdevfs_ctrltransfer	ctrl;
+    int					status;
+
+    /* 8 bytes SETUP */
+    ctrl.bRequestType = req->request_type;
+    ctrl.bRequest = req->request;
+    ctrl.wValue   = req->value;
+    ctrl.wLength  = req->length;
+    ctrl.wIndex = req->index;
+
+    /* "length" bytes DATA */
+    ctrl.data = req->data;
+
+    ctrl.timeout = req->timeout;
+
+    status = ioctl (dev->fd, USBDEVFS_CONTROL, &ctrl);
+    return (status < 0) ? -errno : status;
+}
+
+const struct ezusb_transport ezusb_usbfs_transport = {
+    .name =	"usbfs",
+    .control =	usbfs_control,
+    .urbs =	1,
+};
+
+/*
+ * Reaps a completed URB, handing back any that usbfs_async_control()
+ * reaped first; REAPURB blocks, REAPURBNDELAY doesn't.  Like ioctl(),
+ * returns -1 and sets errno on failure.
+ */
+static int usbfs_reap (struct ezusb *dev, unsigned long request,
+	struct usbdevfs_urb **urb)
+{
+    if (dev->nstray) {
+	*urb = dev->stray [--dev->nstray];
+	return 0;
+    }
+    return ioctl (dev->fd, request, urb);
+}
+
+/* keeps another request's URB for usbfs_reap() */
+static void usbfs_stray (struct ezusb *dev, struct usbdevfs_urb *urb)
+{
+    if (dev->nstray < STRAY_MAX)
+	dev->stray [dev->nstray++] = urb;
+    else {
+	dev->stats.errors++;
+	ezusb_log (dev, "dropped a completed URB\n");
+    }
+}
+
+static int usbfs_async_control (struct ezusb *dev, void *arg,
+	const struct ezusb_ctrl *req)
+{
+    struct usbdevfs_urb		urb, *done;
+    struct pollfd		pfd;
+    unsigned char		*buf;
+    long long			deadline, left;
+    int				status;
+
+    buf = malloc (8 + req->length);
+    if (!buf)
+	return -ENOMEM;
+    buf [0] = req->request_type;
+    buf [1] = req->request;
+    buf [2] = req->value;
+    buf [3] = req->value >> 8;
+    buf [4] = req->index;
+    buf [5] = req->index >> 8;
+    buf [6] = req->length;
+    buf [7] = req->length >> 8;
+    if (!(req->request_type & USB_DIR_IN))
+	memcpy (buf + 8, req->data, req->length);
+
+    memset (&urb, 0, sizeof urb);
+    urb.type = USBDEVFS_URB_TYPE_CONTROL;
+    urb.endpoint = 0;
+    urb.buffer = buf;
+    urb.buffer_length = 8 + req->length;
+    if (ioctl (dev->fd, USBDEVFS_SUBMITURB, &urb) < 0) {
+	status = -errno;
+	goto done;
+    }
+
+    /* wakeups for other URBs mustn't stretch this one's timeout; those
+     * URBs are kept for whoever queued them, and until this one's been
+     * reaped the kernel still owns its buffer
+     */
+    deadline = ezusb_msec () + req->timeout;
+    pfd.fd = dev->fd;
+    pfd.events = POLLOUT;
+    for (;;) {
+	if (ioctl (dev->fd, USBDEVFS_REAPURBNDELAY, &done) == 0) {
+	    if (done == &urb)
+		break;
+	    usbfs_stray (dev, done);
+	    continue;
+	}
+	status = -errno;
+	if (status == -EAGAIN) {
+	    left = deadline - ezusb_msec ();
+	    if (left <= 0)
+		status = -ETIMEDOUT;
+	    else if (poll (&pfd, 1, left) >= 0 || errno == EINTR)
+		continue;
+	    else
+		status = -errno;
+	}
+	ioctl (dev->fd, USBDEVFS_DISCARDURB, &urb);
+	while (ioctl (dev->fd, USBDEVFS_REAPURB, &done) == 0
+		&& done != &urb)
+	    usbfs_stray (dev, done);
+	goto done;
+    }
+
+    status = urb.status;
+    if (status == 0) {
+	status = urb.actual_length;
+	if (req->request_type & USB_DIR_IN)
+	    memcpy (req->data, buf + 8, status);
+    }
+done:
+    free (buf);
+    return status;
+}
+
+const struct ezusb_transport ezusb_usbfs_async_transport = {
+    .name =	"usbfs-async",
+    .control =	usbfs_async_control,
+    .urbs =	1,
+};
+
+/*
+ * Issue a control request to the specified device, through whatever
+ * transport the context uses.  Like ioctl(), this returns -1 and sets
+ * errno on failure.
  */
 static inline int ctrl_msg (
-    int					device,
+    struct ezusb			*dev,
     unsigned char			requestType,
     unsigned char			request,
     unsigned short			value,
@@ -142,26 +514,34 @@ static inline int ctrl_msg (
     unsigned char			*data,
     size_t				length
 ) {
-    struct usbdevfs_ctrltransfer	ctrl;
+    struct ezusb_ctrl			ctrl;
+    int					status;
 
     if (length > USHRT_MAX) {
-	logerror("length too big\n");
+	ezusb_log (dev, "length too big\n");
 	return -EINVAL;
     }
 
-    /* 8 bytes SETUP */
-    ctrl.bRequestType = requestType;
-    ctrl.bRequest = request;
-    ctrl.wValue   = value;
-    ctrl.wLength  = (unsigned short) length;
-    ctrl.wIndex = index;
-
-    /* "length" bytes DATA */
+    ctrl.request_type = requestType;
+    ctrl.request = request;
+    ctrl.value = value;
+    ctrl.index = index;
+    ctrl.length = length;
     ctrl.data = data;
+    ctrl.timeout = dev->timeout;
 
-    ctrl.timeout = 10000;
-
-    return ioctl (device, USBDEVFS_CONTROL, &ctrl);
+    dev->stats.requests++;
+    status = dev->transport->control (dev, dev->transport_arg, &ctrl);
+    if (status < 0) {
+	dev->stats.errors++;
+	errno = -status;
+	return -1;
+    }
+    if (requestType & USB_DIR_IN)
+	dev->stats.bytes_in += status;
+    else
+	dev->stats.bytes_out += status;
+    return status;
 }
 
 
@@ -180,58 +560,60 @@ static inline int ctrl_msg (
 
 
 /*
- * Issues the specified vendor-specific read request.
+ * Issues the specified vendor-specific read request.  Addresses past
+ * 64 KB (only for large EEPROMs) carry their high bits in wIndex.
  */
 static int ezusb_read (
-    int					device,
+    struct ezusb			*dev,
     char				*label,
     unsigned char			opcode,
-    unsigned short			addr,
+    unsigned				addr,
     unsigned char			*data,
     size_t				len
 ) {
     int					status;
 
-    if (verbose)
-	logerror("%s, addr 0x%04x len %4zd (0x%04zx)\n", label, addr, len, len);
-    status = ctrl_msg (device,
+    if (dev->verbose)
+	ezusb_log (dev, "%s, addr 0x%04x len %4zd (0x%04zx)\n", label, addr, len, len);
+    status = ctrl_msg (dev,
 	USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE, opcode,
-	addr, 0,
+	addr & 0xffff, addr >> 16,
 	data, len);
     if (status != len) {
 	if (status < 0)
-	    logerror("%s: %s\n", label, strerror(errno));
+	    ezusb_log (dev, "%s: %s\n", label, strerror(errno));
 	else
-	    logerror("%s ==> %d\n", label, status);
+	    ezusb_log (dev, "%s ==> %d\n", label, status);
     }
     return status;
 }
 
 /*
- * Issues the specified vendor-specific write request.
+ * Issues the specified vendor-specific write request.  Addresses past
+ * 64 KB (only for large EEPROMs) carry their high bits in wIndex.
  */
 static int ezusb_write (
-    int					device,
+    struct ezusb			*dev,
     char				*label,
     unsigned char			opcode,
-    unsigned short			addr,
+    unsigned				addr,
     const unsigned char			*data,
     size_t				len
 ) {
     int					status;
 
-    if (verbose)
-	logerror("%s, addr 0x%04x len %4zd (0x%04zx)\n", label, addr, len, len);
+    if (dev->verbose)
+	ezusb_log (dev, "%s, addr 0x%04x len %4zd (0x%04zx)\n", label, addr, len, len);
 
-    status = ctrl_msg (device,
+    status = ctrl_msg (dev,
 	USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE, opcode,
-	addr, 0,
+	addr & 0xffff, addr >> 16,
 	(unsigned char *) data, len);
     if (status != len) {
 	if (status < 0)
-	    logerror("%s: %s\n", label, strerror(errno));
+	    ezusb_log (dev, "%s: %s\n", label, strerror(errno));
 	else
-	    logerror("%s ==> %d\n", label, status);
+	    ezusb_log (dev, "%s ==> %d\n", label, status);
     }
     return status;
 }
@@ -241,16 +623,16 @@ static int ezusb_write (
  * Returns false on error.
  */
 static int ezusb_cpucs (
-    int			device,
+    struct ezusb	*dev,
     unsigned short	addr,
     int			doRun
 ) {
     int			status;
     unsigned char	data = doRun ? 0 : 1;
 
-    if (verbose)
-	logerror("%s\n", data ? "stop CPU" : "reset CPU");
-    status = ctrl_msg (device,
+    if (dev->verbose)
+	ezusb_log (dev, "%s\n", data ? "stop CPU" : "reset CPU");
+    status = ctrl_msg (dev,
 	USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
 	RW_INTERNAL,
 	addr, 0,
@@ -258,9 +640,9 @@ static int ezusb_cpucs (
     if (status != 1) {
 	char *mesg = "can't modify CPUCS";
 	if (status < 0)
-	    logerror("%s: %s\n", mesg, strerror(errno));
+	    ezusb_log (dev, "%s: %s\n", mesg, strerror(errno));
 	else
-	    logerror("%s\n", mesg);
+	    ezusb_log (dev, "%s\n", mesg);
 	return 0;
     } else
 	return 1;
@@ -271,9 +653,10 @@ static int ezusb_cpucs (
  * *data == 0 means it uses 8 bit addresses (or there is no EEPROM),
  * *data == 1 means it uses 16 bit addresses
  */
-static inline int ezusb_get_eeprom_type (int fd, unsigned char *data)
+static inline int ezusb_get_eeprom_type (struct ezusb *dev,
+	unsigned char *data)
 {
-    return ezusb_read (fd, "get EEPROM size", GET_EEPROM_SIZE, 0, data, 1);
+    return ezusb_read (dev, "get EEPROM size", GET_EEPROM_SIZE, 0, data, 1);
 }
 
 /*****************************************************************************/
@@ -294,7 +677,8 @@ static inline int ezusb_get_eeprom_type (int fd, unsigned char *data)
  * Caller is responsible for halting CPU as needed, such as when
  * overwriting a second stage loader.
  */
-int parse_ihex (
+static int parse_ihex (
+    struct ezusb *dev,
     FILE	*image,
     void	*context,
     int		(*is_external)(unsigned short addr, size_t len),
@@ -327,7 +711,7 @@ int parse_ihex (
 
 	cp = fgets(buf, sizeof buf, image);
 	if (cp == 0) {
-	    logerror("EOF without EOF record!\n");
+	    ezusb_log (dev, "EOF without EOF record!\n");
 	    break;
 	}
 
@@ -336,7 +720,7 @@ int parse_ihex (
 	    continue;
 
 	if (buf[0] != ':') {
-	    logerror("not an ihex record: %s", buf);
+	    ezusb_log (dev, "not an ihex record: %s", buf);
 	    return -2;
 	}
 
@@ -345,8 +729,8 @@ int parse_ihex (
 	if (cp)
 	    *cp = 0;
 
-	if (verbose >= 3)
-	    logerror("** LINE: %s\n", buf);
+	if (dev->verbose >= 3)
+	    ezusb_log (dev, "** LINE: %s\n", buf);
 
 	/* Read the length field (up to 16 bytes) */
 	tmp = buf[3];
@@ -374,18 +758,18 @@ int parse_ihex (
 
 	/* If this is an EOF record, then make it so. */
 	if (type == 1) {
-	    if (verbose >= 2)
-		logerror("EOF on hexfile\n");
+	    if (dev->verbose >= 2)
+		ezusb_log (dev, "EOF on hexfile\n");
 	    break;
 	}
 
 	if (type != 0) {
-	    logerror("unsupported record type: %u\n", type);
+	    ezusb_log (dev, "unsupported record type: %u\n", type);
 	    return -3;
 	}
 
 	if ((len * 2) + 11 > strlen(buf)) {
-	    logerror("record too short?\n");
+	    ezusb_log (dev, "record too short?\n");
 	    return -4;
 	}
 
@@ -446,7 +830,7 @@ typedef enum {
 } ram_mode;
 
 struct ram_poke_context {
-    int		device;
+    struct ezusb *dev;
     ram_mode	mode;
     unsigned	total, count;
 };
@@ -461,21 +845,22 @@ static int ram_poke (
     size_t		len
 ) {
     struct ram_poke_context	*ctx = context;
+    struct ezusb	*dev = ctx->dev;
     int			rc;
     unsigned		retry = 0;
 
     switch (ctx->mode) {
     case internal_only:		/* CPU should be stopped */
 	if (external) {
-	    logerror("can't write %zd bytes external memory at 0x%04x\n",
+	    ezusb_log (dev, "can't write %zd bytes external memory at 0x%04x\n",
 		len, addr);
 	    return -EINVAL;
 	}
 	break;
     case skip_internal:		/* CPU must be running */
 	if (!external) {
-	    if (verbose >= 2) {
-		logerror("SKIP on-chip RAM, %zd bytes at 0x%04x\n",
+	    if (dev->verbose >= 2) {
+		ezusb_log (dev, "SKIP on-chip RAM, %zd bytes at 0x%04x\n",
 		    len, addr);
 	    }
 	    return 0;
@@ -483,15 +868,15 @@ static int ram_poke (
 	break;
     case skip_external:		/* CPU should be stopped */
 	if (external) {
-	    if (verbose >= 2) {
-		logerror("SKIP external RAM, %zd bytes at 0x%04x\n",
+	    if (dev->verbose >= 2) {
+		ezusb_log (dev, "SKIP external RAM, %zd bytes at 0x%04x\n",
 		    len, addr);
 	    }
 	    return 0;
 	}
 	break;
     default:
-	logerror("bug\n");
+	ezusb_log (dev, "bug\n");
 	return -EDOM;
     }
 
@@ -501,7 +886,7 @@ static int ram_poke (
     /* Retry this till we get a real error. Control messages are not
      * NAKed (just dropped) so time out means is a real problem.
      */
-    while ((rc = ezusb_write (ctx->device,
+    while ((rc = ezusb_write (dev,
 		    external ? "write external" : "write on-chip",
 		    external ? RW_MEMORY : RW_INTERNAL,
 		    addr, data, len)) < 0
@@ -509,14 +894,122 @@ static int ram_poke (
 	  if (errno != ETIMEDOUT)
 		break;
 	  retry += 1;
+	  dev->stats.retries++;
     }
-    return (rc < 0) ? -errno : 0;
+    if (rc < 0)
+	return -errno;
+    progress_add (dev, EZUSB_PROGRESS_RAM, len);
+    return 0;
 }
 
 /*
- * Load an Intel HEX file into target RAM. The fd is the open "usbfs"
- * device, and the path is the name of the source file. Open the file,
- * parse the bytes, and write them in one or two phases.
+ * A hexfile parsed once and kept in memory, as a list of segments,
+ * so it can be downloaded into many devices without being reread.
+ * Which segments are external depends on the device type, so that's
+ * only decided when downloading.
+ */
+struct ezusb_image {
+    struct ram_segment {
+	unsigned short	addr;
+	unsigned	len;
+	unsigned char	*data;
+    }			*seg;
+    unsigned		count, alloc;
+};
+
+static int image_collect (
+    void		*context,
+    unsigned short	addr,
+    int			external,
+    const unsigned char	*data,
+    size_t		len
+) {
+    struct ezusb_image	*image = context;
+    struct ram_segment	*seg;
+
+    if (image->count == image->alloc) {
+	unsigned		alloc = image->alloc ? 2 * image->alloc : 32;
+
+	seg = realloc (image->seg, alloc * sizeof *seg);
+	if (!seg)
+	    return -ENOMEM;
+	image->seg = seg;
+	image->alloc = alloc;
+    }
+    seg = &image->seg [image->count];
+    seg->data = malloc (len);
+    if (!seg->data)
+	return -ENOMEM;
+    memcpy (seg->data, data, len);
+    seg->addr = addr;
+    seg->len = len;
+    image->count++;
+    return 0;
+}
+
+struct ezusb_image *ezusb_image_read (struct ezusb *dev, const char *path)
+{
+    FILE			*f;
+    struct ezusb_image		*image;
+    int				status;
+
+    f = fopen (path, "r");
+    if (f == 0) {
+	ezusb_log (dev, "%s: unable to open for input.\n", path);
+	return NULL;
+    } else if (dev->verbose)
+	ezusb_log (dev, "open RAM hexfile image %s\n", path);
+
+    image = calloc (1, sizeof *image);
+    if (!image) {
+	fclose (f);
+	return NULL;
+    }
+    status = parse_ihex (dev, f, image, NULL, image_collect);
+    fclose (f);
+    if (status < 0) {
+	ezusb_log (dev, "unable to parse %s\n", path);
+	ezusb_image_free (image);
+	return NULL;
+    }
+    return image;
+}
+
+void ezusb_image_free (struct ezusb_image *image)
+{
+    unsigned		i;
+
+    if (!image)
+	return;
+    for (i = 0; i < image->count; i++)
+	free (image->seg [i].data);
+    free (image->seg);
+    free (image);
+}
+
+/* hands each segment of the image to ram_poke() */
+static int image_poke (
+    const struct ezusb_image	*image,
+    struct ram_poke_context	*ctx,
+    int				(*is_external)(unsigned short addr, size_t len)
+) {
+    unsigned			i;
+    int				status;
+
+    for (i = 0; i < image->count; i++) {
+	const struct ram_segment	*seg = &image->seg [i];
+
+	status = ram_poke (ctx, seg->addr, is_external (seg->addr, seg->len),
+		seg->data, seg->len);
+	if (status < 0)
+	    return status;
+    }
+    return 0;
+}
+
+/*
+ * Load a parsed Intel HEX file into target RAM. The fd is the open
+ * "usbfs" device.
  *
  * If stage == 0, this uses the first stage loader, built into EZ-USB
  * hardware but limited to writing on-chip memory or CPUCS.  Everything
@@ -525,23 +1018,18 @@ static int ram_poke (
  *
  * Otherwise, things are written in two stages.  First the external
  * memory is written, expecting a second stage loader to have already
- * been loaded.  Then file is re-parsed and on-chip memory is written.
+ * been loaded.  Then the image is rescanned and on-chip memory is written.
  */
-int ezusb_load_ram (int fd, const char *path, int fx2, int stage)
+int ezusb_load_image (struct ezusb *dev, const struct ezusb_image *image,
+	int fx2, int stage)
 {
-    FILE			*image = NULL;
     unsigned short		cpucs_addr;
     int				(*is_external)(unsigned short off, size_t len);
     struct ram_poke_context	ctx;
+    unsigned long		total = 0;
+    unsigned			i;
     int				status;
 
-    image = fopen (path, "r");
-    if (image == 0) {
-	logerror("%s: unable to open for input.\n", path);
-	return -2;
-    } else if (verbose)
-	logerror("open RAM hexfile image %s\n", path);
-
     /* EZ-USB original/FX and FX2 devices differ, apart from the 8051 core */
     if (fx2 == 2) {
 	cpucs_addr = 0xe600;
@@ -559,7 +1047,7 @@ int ezusb_load_ram (int fd, const char *path, int fx2, int stage)
 	ctx.mode = internal_only;
 
 	/* don't let CPU run while we overwrite its code/data */
-	if (!ezusb_cpucs (fd, cpucs_addr, 0))
+	if (!ezusb_cpucs (dev, cpucs_addr, 0))
 	    return -1;
 
     /* 2nd stage, first part? loader was already downloaded */
@@ -567,16 +1055,21 @@ int ezusb_load_ram (int fd, const char *path, int fx2, int stage)
 	ctx.mode = skip_internal;
 
 	/* let CPU run; overwrite the 2nd stage loader later */
-	if (verbose)
-	    logerror("2nd stage:  write external memory\n");
+	if (dev->verbose)
+	    ezusb_log (dev, "2nd stage:  write external memory\n");
     }
 
+    /* each segment is written once, whether in one stage or two */
+    for (i = 0; i < image->count; i++)
+	total += image->seg [i].len;
+    progress_begin (dev, EZUSB_PROGRESS_RAM, total);
+
     /* scan the image, first (maybe only) time */
-    ctx.device = fd;
+    ctx.dev = dev;
     ctx.total = ctx.count = 0;
-    status = parse_ihex (image, &ctx, is_external, ram_poke);
+    status = image_poke (image, &ctx, is_external);
     if (status < 0) {
-	logerror("unable to download %s\n", path);
+	ezusb_log (dev, "unable to download firmware\n");
 	return status;
     }
 
@@ -585,132 +1078,873 @@ int ezusb_load_ram (int fd, const char *path, int fx2, int stage)
 	ctx.mode = skip_external;
 
 	/* don't let CPU run while we overwrite the 1st stage loader */
-	if (!ezusb_cpucs (fd, cpucs_addr, 0))
+	if (!ezusb_cpucs (dev, cpucs_addr, 0))
 	    return -1;
 
 	/* at least write the interrupt vectors (at 0x0000) for reset! */
-	rewind (image);
-	if (verbose)
-	    logerror("2nd stage:  write on-chip memory\n");
-	status = parse_ihex (image, &ctx, is_external, ram_poke);
+	if (dev->verbose)
+	    ezusb_log (dev, "2nd stage:  write on-chip memory\n");
+	status = image_poke (image, &ctx, is_external);
 	if (status < 0) {
-	    logerror("unable to completely download %s\n", path);
+	    ezusb_log (dev, "unable to completely download firmware\n");
 	    return status;
 	}
     }
 
-    if (verbose)
-	logerror("... WROTE: %d bytes, %d segments, avg %d\n",
+    if (dev->verbose && ctx.count)
+	ezusb_log (dev, "... WROTE: %d bytes, %d segments, avg %d\n",
 	    ctx.total, ctx.count, ctx.total / ctx.count);
+    progress_end (dev, EZUSB_PROGRESS_RAM);
 
     /* now reset the CPU so it runs what we just downloaded */
-    if (!ezusb_cpucs (fd, cpucs_addr, 1))
+    if (!ezusb_cpucs (dev, cpucs_addr, 1))
 	return -1;
 
     return 0;
 }
 
+/*
+ * Load an Intel HEX file into target RAM. The fd is the open "usbfs"
+ * device, and the path is the name of the source file.  It's parsed
+ * once, then written as ezusb_load_image() describes.
+ */
+int ezusb_load_ram (struct ezusb *dev, const char *path, int fx2, int stage)
+{
+    struct ezusb_image		*image;
+    int				status;
+
+    image = ezusb_image_read (dev, path);
+    if (!image)
+	return -2;
+    status = ezusb_load_image (dev, image, fx2, stage);
+    if (status < 0)
+	ezusb_log (dev, "unable to download %s\n", path);
+    ezusb_image_free (image);
+    return status;
+}
+
 /*****************************************************************************/
 
 /*
- * For writing to EEPROM using a 2nd stage loader
+ * I2C serial EEPROMs commit writes one page at a time; the 24LC64 has
+ * 32 byte pages, smaller parts use 8 or 16 bytes and larger ones 64 or
+ * 128.  A write which straddles a page boundary costs the loader an
+ * extra write cycle (several msec each), so EEPROM data is streamed
+ * through a small buffer that's only flushed at page boundaries, or
+ * when the data isn't contiguous.
  */
-struct eeprom_poke_context {
-    int			device;
-    unsigned short	ee_addr;	/* next free address */
-    int			last;
-    unsigned char eeprom_request; /* Request to USE to access the EEPROM */
-};
 
-static int eeprom_poke (
-    void		*context,
-    unsigned short	addr,
-    int			external,
-    const unsigned char	*data,
-    size_t		len
-) {
-    struct eeprom_poke_context	*ctx = context;
-    int			rc;
-    unsigned char	header [4];
+#define EEPROM_PAGE_MAX	256
 
-    if (external) {
-      logerror(
-	    "EEPROM can't init %zd bytes external memory at 0x%04x\n",
-	    len, addr);
-	return -EINVAL;
-    }
+struct eeprom_writer {
+    struct ezusb	*dev;
+    unsigned char	request;	/* RW_EEPROM or RW_EEPROM_LARGE */
+    unsigned		page_size;
+    unsigned		addr;		/* of buffered data */
+    size_t		len;
+    unsigned char	buf [EEPROM_PAGE_MAX];
 
-    if (len > 1023) {
-	logerror("not fragmenting %zd bytes\n", len);
-	return -EDOM;
-    }
+    /* statistics */
+    unsigned		total;		/* bytes written */
+    unsigned		writes;		/* page write cycles */
+};
 
-    /* NOTE:  No retries here.  They don't seem to be needed;
-     * could be added if that changes.
-     */
+/*
+ * Chooses the page size:  as given with "-p", else a conservative guess
+ * based on whether the part uses 8 bit (24LC00..24LC16) or 16 bit
+ * (24LC32 and up) addresses.  Smaller pages are always safe.
+ */
+static unsigned eeprom_choose_page_size (struct ezusb *dev, int large_eeprom)
+{
+    unsigned char	value = 0;
+
+    if (dev->page_size > 0)
+	return dev->page_size;
+    if (!large_eeprom && ezusb_get_eeprom_type (dev, &value) == 1
+	    && value == 0)
+	return 8;
+    return 32;
+}
 
-    /* write header */
-    header [0] = len >> 8;
-    header [1] = len;
-    header [2] = addr >> 8;
-    header [3] = addr;
-    if (ctx->last)
-	header [0] |= 0x80;
-    if ((rc = ezusb_write (ctx->device, "write EEPROM segment header",
-		    ctx->eeprom_request,
-		    ctx->ee_addr, header, 4)) < 0)
-	return rc;
+static void eeprom_writer_init (
+    struct eeprom_writer	*w,
+    struct ezusb		*dev,
+    unsigned char		request,
+    unsigned			page_size
+) {
+    memset (w, 0, sizeof *w);
+    w->dev = dev;
+    w->request = request;
+    w->page_size = page_size;
+}
+
+static int eeprom_flush (struct eeprom_writer *w)
+{
+    int			rc;
 
-    /* write code/data */
-    if ((rc = ezusb_write (ctx->device, "write EEPROM segment",
-		    ctx->eeprom_request,
-		    ctx->ee_addr + 4, data, len)) < 0)
+    if (w->len == 0)
+	return 0;
+    rc = ezusb_write (w->dev, "write EEPROM page", w->request,
+	    w->addr, w->buf, w->len);
+    if (rc < 0)
 	return rc;
+    progress_add (w->dev, EZUSB_PROGRESS_EEPROM, w->len);
+    w->total += w->len;
+    w->writes++;
+    w->addr += w->len;
+    w->len = 0;
+    return 0;
+}
 
-    /* next shouldn't overwrite it */
-    ctx->ee_addr += 4 + len;
+/*
+ * Queue data for writing to EEPROM.  Nothing reaches the device until
+ * a page fills up, a discontiguous address is written, or the caller
+ * flushes the writer.
+ */
+static int eeprom_stream (
+    struct eeprom_writer	*w,
+    unsigned			addr,
+    const unsigned char		*data,
+    size_t			len
+) {
+    int				rc;
 
+    if (w->len != 0 && addr != w->addr + w->len) {
+	if ((rc = eeprom_flush (w)) < 0)
+	    return rc;
+    }
+    if (w->len == 0)
+	w->addr = addr;
+
+    while (len != 0) {
+	size_t		room;
+
+	room = w->page_size - ((w->addr + w->len) % w->page_size);
+	if (room > len)
+	    room = len;
+	memcpy (w->buf + w->len, data, room);
+	w->len += room;
+	data += room;
+	len -= room;
+
+	if (((w->addr + w->len) % w->page_size) == 0) {
+	    if ((rc = eeprom_flush (w)) < 0)
+		return rc;
+	}
+    }
     return 0;
 }
 
 /*
- * Load an Intel HEX file into target (large) EEPROM, set up to boot from
- * that EEPROM using the specified microcontroller-specific config byte.
- * (Defaults:  FX2 0x08, FX 0x00, AN21xx n/a)
+ * The boot image is built in memory before anything is written, so
+ * that an update can compare it against what's already in the EEPROM.
+ * Bytes which aren't part of the image (such as VID/PID on parts where
+ * those aren't provided) are left alone.
  *
- * Caller must have pre-loaded a second stage loader that knows how
- * to handle the EEPROM write requests.
+ * The boot ROM only reads the first 64 KB, but prebuilt images may
+ * also cover the rest of larger parts (24LC1025 and up).
  */
-int ezusb_load_eeprom (int dev, const char *path, const char *type, int config, int large_eeprom,
-	int ww_config_vid,int ww_config_pid)
-{
-    FILE			*image;
-    unsigned short		cpucs_addr;
-    int				(*is_external)(unsigned short off, size_t len);
-    struct eeprom_poke_context	ctx;
-    int				status;
-    unsigned char		value, first_byte;
-    unsigned short ww_vid=0,ww_pid=0;
+#define EEPROM_BOOT_MAX		0x10000
+#define EEPROM_IMAGE_MAX	0x40000
 
-    if (path) {
-	if ((status=ezusb_get_eeprom_type (dev, &value)) != 1 || value != 1) {
-            logerror("don't see a large enough EEPROM, status=%d, val=%d%s\n",
-                     status,value,value==0 ? " (ignored)" : "");
-            if(value!=0) return -1;
-	}
+struct eeprom_image {
+    unsigned char	*data;
+    unsigned char	*valid;		/* nonzero iff data[i] is defined */
+    unsigned		len;		/* high water mark */
+};
 
-        image = fopen (path, "r");
-        if (image == 0) {
-            logerror("%s: unable to open for input.\n", path);
-            return -2;
-        } else if (verbose)
-            logerror("open EEPROM hexfile image %s\n", path);
-    } else {
-        image = NULL;
+static int eeprom_image_init (struct ezusb *dev, struct eeprom_image *img)
+{
+    img->data = malloc (EEPROM_IMAGE_MAX);
+    img->valid = calloc (EEPROM_IMAGE_MAX, 1);
+    img->len = 0;
+    if (!img->data || !img->valid) {
+	free (img->data);
+	free (img->valid);
+	ezusb_log (dev, "no memory for EEPROM image\n");
+	return -ENOMEM;
+    }
+    return 0;
+}
+
+static void eeprom_image_free (struct eeprom_image *img)
+{
+    free (img->data);
+    free (img->valid);
+    img->data = img->valid = NULL;
+}
+
+static int eeprom_image_put (
+    struct ezusb	*dev,
+    struct eeprom_image	*img,
+    unsigned		addr,
+    const unsigned char	*data,
+    size_t		len
+) {
+    if (addr + len > EEPROM_IMAGE_MAX) {
+	ezusb_log (dev, "EEPROM image overflows at 0x%05x\n", addr);
+	return -ENOSPC;
+    }
+    memcpy (img->data + addr, data, len);
+    memset (img->valid + addr, 1, len);
+    if (addr + len > img->len)
+	img->len = addr + len;
+    return 0;
+}
+
+/*
+ * Reading large areas one synchronous control request at a time leaves
+ * the bus idle while each request is set up and completed.  Instead,
+ * several requests are queued with usbfs and reaped as they complete.
+ * EP0 handles them in order, so the loader never sees them overlap.
+ */
+#define EEPROM_READ_CHUNK	2048
+#define EEPROM_READ_DEPTH	4
+
+struct ctrl_urb {
+    struct usbdevfs_urb		urb;
+    unsigned			offset;		/* into caller's buffer */
+    int				busy, done;
+    unsigned char		buf [8 + EEPROM_READ_CHUNK];
+};
+
+static int ctrl_urb_submit (
+    struct ezusb			*dev,
+    struct ctrl_urb		*u,
+    unsigned char		requestType,
+    unsigned char		request,
+    unsigned short		value,
+    unsigned short		index,
+    size_t			len
+) {
+    /* 8 bytes SETUP, little endian */
+    u->buf [0] = requestType;
+    u->buf [1] = request;
+    u->buf [2] = value;
+    u->buf [3] = value >> 8;
+    u->buf [4] = index;
+    u->buf [5] = index >> 8;
+    u->buf [6] = len;
+    u->buf [7] = len >> 8;
+
+    memset (&u->urb, 0, sizeof u->urb);
+    u->urb.type = USBDEVFS_URB_TYPE_CONTROL;
+    u->urb.endpoint = 0;
+    u->urb.buffer = u->buf;
+    u->urb.buffer_length = 8 + len;
+    u->urb.usercontext = u;
+
+    /* other transports don't have URBs, so callers fall back */
+    if (!dev->transport->urbs)
+	return -ENOTTY;
+
+    dev->stats.requests++;
+    if (ioctl (dev->fd, USBDEVFS_SUBMITURB, &u->urb) < 0) {
+	dev->stats.errors++;
+	return -errno;
+    }
+    u->busy = 1;
+    u->done = 0;
+    return 0;
+}
+
+/*
+ * Waits for one queued request to complete, up to the same timeout
+ * ctrl_msg() uses.  On timeout everything still queued is discarded.
+ */
+static struct ctrl_urb *ctrl_urb_reap (struct ezusb *dev, struct ctrl_urb *urbs, int n)
+{
+    struct usbdevfs_urb		*urb;
+    struct pollfd		pfd;
+    long long			deadline, left;
+    int				i, busy;
+
+    deadline = ezusb_msec () + dev->timeout;
+    pfd.fd = dev->fd;
+    pfd.events = POLLOUT;
+    for (;;) {
+	if (usbfs_reap (dev, USBDEVFS_REAPURBNDELAY, &urb) == 0) {
+	    struct ctrl_urb	*u = urb->usercontext;
+
+	    u->busy = 0;
+	    return u;
+	}
+	if (errno != EAGAIN)
+	    return NULL;
+
+	/* wakeups mustn't restart the timeout */
+	left = deadline - ezusb_msec ();
+	if (left > 0 && (poll (&pfd, 1, left) >= 0 || errno == EINTR))
+	    continue;
+
+	/* give up on all of them; REAPURB blocks, so only reap
+	 * as many as are still queued
+	 */
+	for (i = busy = 0; i < n; i++) {
+	    if (urbs [i].busy) {
+		ioctl (dev->fd, USBDEVFS_DISCARDURB, &urbs [i].urb);
+		busy++;
+	    }
+	}
+	while (busy-- > 0 && usbfs_reap (dev, USBDEVFS_REAPURB, &urb) == 0)
+	    ((struct ctrl_urb *) urb->usercontext)->busy = 0;
+	errno = ETIMEDOUT;
+	return NULL;
+    }
+}
+
+/*
+ * Returns how much of [addr,addr+len) one read request may cover:
+ * a chunk, not crossing a 64 KB bank boundary.
+ */
+static unsigned eeprom_read_len (unsigned addr, unsigned len)
+{
+    unsigned		bank = 0x10000 - (addr & 0xffff);
+
+    if (len > EEPROM_READ_CHUNK)
+	len = EEPROM_READ_CHUNK;
+    return (len > bank) ? bank : len;
+}
+
+/*
+ * Reads up to len bytes from the EEPROM at addr.  If content_end is
+ * provided, it's called as data arrives to learn where the interesting
+ * data ends, so the rest of the part needn't be read.  Returns the
+ * number of bytes read, else negative errno.
+ */
+static int eeprom_read_until (
+    struct ezusb		*dev,
+    unsigned char	request,
+    unsigned		addr,
+    unsigned char	*data,
+    unsigned		len,
+    unsigned		(*content_end)(const unsigned char *data,
+				unsigned have, unsigned len, int *known)
+) {
+    struct ctrl_urb	*urbs;
+    unsigned		submitted = 0, completed = 0, end = len;
+    unsigned		head = 0, tail = 0, n;
+    int			known = !content_end;
+    int			i, inflight = 0, sync = 0, status = 0;
+
+    urbs = calloc (EEPROM_READ_DEPTH, sizeof *urbs);
+    if (!urbs)
+	return -ENOMEM;
+
+    while (completed < end) {
+	struct ctrl_urb	*u;
+
+	if (sync) {
+	    n = eeprom_read_len (addr + completed, end - completed);
+	    status = ezusb_read (dev, "read EEPROM", request,
+		    addr + completed, data + completed, n);
+	    if (status != n) {
+		status = (status < 0) ? -errno : -EIO;
+		break;
+	    }
+	    status = 0;
+	    completed += n;
+	    progress_add (dev, EZUSB_PROGRESS_READ, n);
+	    goto check_end;
+	}
+
+	/* keep the queue full */
+	while (inflight < EEPROM_READ_DEPTH && submitted < end) {
+	    unsigned	a = addr + submitted;
+
+	    n = eeprom_read_len (a, end - submitted);
+	    u = &urbs [tail];
+	    if (dev->verbose)
+		ezusb_log (dev, "read EEPROM, addr 0x%04x len %4u (queued)\n",
+		    a, n);
+	    status = ctrl_urb_submit (dev, u,
+		    USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+		    request, a & 0xffff, a >> 16, n);
+	    if (status < 0)
+		break;
+	    u->offset = submitted;
+	    submitted += n;
+	    tail = (tail + 1) % EEPROM_READ_DEPTH;
+	    inflight++;
+	}
+	if (status < 0) {
+	    /* usbfs without URB support?  read synchronously */
+	    if (inflight == 0 && (status == -ENOTTY || status == -EINVAL)) {
+		sync = 1;
+		status = 0;
+		continue;
+	    }
+	    ezusb_log (dev, "read EEPROM: %s\n", strerror(-status));
+	    break;
+	}
+
+	u = ctrl_urb_reap (dev, urbs, EEPROM_READ_DEPTH);
+	if (!u) {
+	    status = -errno;
+	    ezusb_log (dev, "read EEPROM: %s\n", strerror(errno));
+	    break;
+	}
+	inflight--;
+	if (u->urb.status < 0
+		|| u->urb.actual_length != u->urb.buffer_length - 8) {
+	    ezusb_log (dev, "read EEPROM ==> %d, status %d\n",
+		u->urb.actual_length, u->urb.status);
+	    status = (u->urb.status < 0) ? u->urb.status : -EIO;
+	    break;
+	}
+	memcpy (data + u->offset, u->buf + 8, u->urb.actual_length);
+	dev->stats.bytes_in += u->urb.actual_length;
+	progress_add (dev, EZUSB_PROGRESS_READ, u->urb.actual_length);
+	u->done = 1;
+
+	/* requests complete in order, but don't depend on that */
+	while (head != tail && urbs [head].done) {
+	    completed = urbs [head].offset + urbs [head].urb.actual_length;
+	    urbs [head].done = 0;
+	    head = (head + 1) % EEPROM_READ_DEPTH;
+	}
+
+check_end:
+	if (!known) {
+	    end = content_end (data, completed, len, &known);
+	    if (end > len)
+		end = len;
+	}
+    }
+
+    /* anything still queued was read ahead past the end, or follows
+     * an error; either way it's not needed
+     */
+    for (i = n = 0; i < EEPROM_READ_DEPTH; i++) {
+	if (urbs [i].busy) {
+	    ioctl (dev->fd, USBDEVFS_DISCARDURB, &urbs [i].urb);
+	    n++;
+	}
+    }
+    while (n-- > 0) {
+	struct usbdevfs_urb	*urb;
+
+	if (usbfs_reap (dev, USBDEVFS_REAPURB, &urb) < 0)
+	    break;
+    }
+    free (urbs);
+
+    return (status < 0) ? status : end;
+}
+
+static int eeprom_read (
+    struct ezusb		*dev,
+    unsigned char	request,
+    unsigned		addr,
+    unsigned char	*data,
+    size_t		len
+) {
+    int			status;
+
+    status = eeprom_read_until (dev, request, addr, data, len, NULL);
+    return (status < 0) ? status : 0;
+}
+
+/*
+ * Writes the image, except for the type byte at offset zero, limited
+ * to pages flagged in pages[] (one flag per page).  When the old EEPROM
+ * contents are provided, pages which already match the image are
+ * skipped; undefined bytes in the others are rewritten with their old
+ * values.  On return only the pages written are flagged.  Returns the
+ * number of pages written.
+ */
+static int eeprom_write_image (
+    struct eeprom_writer	*w,
+    const struct eeprom_image	*img,
+    const unsigned char		*old,
+    unsigned char		*pages
+) {
+    unsigned			page, start, end, i;
+    int				status, count = 0;
+
+    for (page = 0; page < img->len; page += w->page_size) {
+	unsigned char		*flag = pages + page / w->page_size;
+
+	if (!*flag)
+	    continue;
+	start = page ? page : 1;
+	end = page + w->page_size;
+	if (end > img->len)
+	    end = img->len;
+
+	for (i = start; i < end; i++) {
+	    if (img->valid [i] && (!old || old [i] != img->data [i]))
+		break;
+	}
+	if (i == end) {
+	    *flag = 0;
+	    continue;
+	}
+	count++;
+
+	for (i = start; i < end; i++) {
+	    const unsigned char	*byte;
+
+	    if (img->valid [i])
+		byte = img->data + i;
+	    else if (old)
+		byte = old + i;
+	    else
+		continue;
+	    status = eeprom_stream (w, i, byte, 1);
+	    if (status < 0)
+		return status;
+	}
+    }
+    status = eeprom_flush (w);
+    return (status < 0) ? status : count;
+}
+
+/*
+ * Reads back the pages flagged in pages[] and compares the bytes the
+ * image defines, except the type byte.  Runs of flagged pages are read
+ * with a single pipelined request.  Pages that match are unflagged, so
+ * what's left flagged failed; readback[] holds what was read.  Returns
+ * the number of failing pages.
+ */
+static int eeprom_verify_image (
+    struct ezusb			*dev,
+    unsigned char		request,
+    unsigned			page_size,
+    const struct eeprom_image	*img,
+    unsigned char		*pages,
+    unsigned char		*readback
+) {
+    unsigned			npages = (img->len + page_size - 1) / page_size;
+    unsigned			first, last, start, end, i;
+    int				status, failed = 0;
+
+    for (first = 0; first < npages; first = last) {
+	if (!pages [first]) {
+	    last = first + 1;
+	    continue;
+	}
+	for (last = first + 1; last < npages && pages [last]; last++)
+	    continue;
+
+	start = first * page_size;
+	end = last * page_size;
+	if (end > img->len)
+	    end = img->len;
+	status = eeprom_read (dev, request, start, readback + start,
+		end - start);
+	if (status < 0)
+	    return status;
+
+	for (i = first; i < last; i++)
+	    pages [i] = 0;
+	for (i = start ? start : 1; i < end; i++) {
+	    if (img->valid [i] && readback [i] != img->data [i]
+		    && !pages [i / page_size]) {
+		if (dev->verbose)
+		    ezusb_log (dev, "EEPROM verify error at 0x%04x: "
+			"0x%02x != 0x%02x\n",
+			i, readback [i], img->data [i]);
+		pages [i / page_size] = 1;
+		failed++;
+	    }
+	}
+    }
+    return failed;
+}
+
+/*
+ * Segments of the hexfile, collected before they're laid out so the
+ * layout can be optimized.  Each segment in the boot image costs the
+ * boot ROM a four byte header and another I2C read sequence.
+ */
+
+struct eeprom_segment {
+    unsigned short	addr;
+    unsigned		len;
+    unsigned char	*data;
+};
+
+struct eeprom_segments {
+    struct ezusb		*dev;		/* for messages */
+    struct eeprom_segment	*seg;
+    unsigned			count, alloc;
+};
+
+static void eeprom_segments_free (struct eeprom_segments *segs)
+{
+    unsigned		i;
+
+    for (i = 0; i < segs->count; i++)
+	free (segs->seg [i].data);
+    free (segs->seg);
+    segs->seg = NULL;
+    segs->count = segs->alloc = 0;
+}
+
+static int eeprom_collect (
+    void		*context,
+    unsigned short	addr,
+    int			external,
+    const unsigned char	*data,
+    size_t		len
+) {
+    struct eeprom_segments	*segs = context;
+    struct ezusb		*dev = segs->dev;
+    struct eeprom_segment	*seg;
+
+    if (external) {
+      ezusb_log (dev,
+	    "EEPROM can't init %zd bytes external memory at 0x%04x\n",
+	    len, addr);
+	return -EINVAL;
+    }
+
+    if (segs->count == segs->alloc) {
+	unsigned		alloc = segs->alloc ? 2 * segs->alloc : 32;
+
+	seg = realloc (segs->seg, alloc * sizeof *seg);
+	if (!seg)
+	    return -ENOMEM;
+	segs->seg = seg;
+	segs->alloc = alloc;
+    }
+    seg = &segs->seg [segs->count];
+    seg->data = malloc (len);
+    if (!seg->data)
+	return -ENOMEM;
+    memcpy (seg->data, data, len);
+    seg->addr = addr;
+    seg->len = len;
+    segs->count++;
+    return 0;
+}
+
+static int segment_cmp (const void *a, const void *b)
+{
+    const struct eeprom_segment	*sa = a, *sb = b;
+
+    return (int) sa->addr - (int) sb->addr;
+}
+
+/*
+ * The boot ROM spends nine I2C clocks per byte, plus roughly five
+ * bytes' worth of addressing to start reading each segment.
+ */
+#define EEPROM_BYTE_CLOCKS	9
+#define EEPROM_SEGMENT_CLOCKS	(4 * EEPROM_BYTE_CLOCKS + 47)
+
+#if EZUSB_MERGE_GAP_MAX * EEPROM_BYTE_CLOCKS >= EEPROM_SEGMENT_CLOCKS
+#error "EZUSB_MERGE_GAP_MAX would make booting slower"
+#endif
+
+/*
+ * Merges segments which are contiguous in memory; the result may be
+ * too big for one EEPROM segment, and gets fragmented during layout.
+ * With a nonzero "gap", segments are first sorted by address, and
+ * neighbors at most that many bytes apart are merged by filling the
+ * space between them with zeroes, when reading the filler is quicker
+ * than reading another segment.  That's only done where the filler
+ * lands in on-chip RAM, which firmware can't expect to hold anything
+ * in particular at boot.  Segments that overlap are left in hexfile
+ * order, since the later one wins.
+ */
+static int eeprom_optimize (
+    struct ezusb		*dev,
+    struct eeprom_segments	*segs,
+    unsigned			gap,
+    int				(*is_external)(unsigned short, size_t)
+) {
+    struct eeprom_segment	*sorted, *cur, *next;
+    unsigned			i, n;
+
+    if (gap == 0)
+	goto merge;
+
+    sorted = malloc ((segs->count ? segs->count : 1) * sizeof *sorted);
+    if (!sorted)
+	return -ENOMEM;
+    memcpy (sorted, segs->seg, segs->count * sizeof *sorted);
+    qsort (sorted, segs->count, sizeof *sorted, segment_cmp);
+    for (i = 1; i < segs->count; i++) {
+	if (sorted [i - 1].addr + sorted [i - 1].len > sorted [i].addr)
+	    break;
+    }
+    if (i < segs->count) {
+	ezusb_log (dev, "EEPROM segments overlap at 0x%04x, not reordered\n",
+	    sorted [i].addr);
+	free (sorted);
+	gap = 0;
+	goto merge;
+    }
+    free (segs->seg);
+    segs->seg = sorted;
+    segs->alloc = segs->count;
+
+merge:
+    for (i = 0, n = 0; i < segs->count; n++) {
+	cur = &segs->seg [n];
+	*cur = segs->seg [i++];
+
+	while (i < segs->count) {
+	    unsigned		hole, len;
+	    unsigned char	*data;
+
+	    next = &segs->seg [i];
+	    hole = next->addr - (cur->addr + cur->len);
+	    len = cur->len + hole + next->len;
+	    if (hole > gap
+		    || hole * EEPROM_BYTE_CLOCKS >= EEPROM_SEGMENT_CLOCKS
+		    || is_external (cur->addr, len))
+		break;
+
+	    data = realloc (cur->data, len);
+	    if (!data)
+		break;
+	    memset (data + cur->len, 0, hole);
+	    memcpy (data + cur->len + hole, next->data, next->len);
+	    free (next->data);
+	    cur->data = data;
+	    cur->len = len;
+	    i++;
+	}
+    }
+    if (dev->verbose && n != segs->count)
+	ezusb_log (dev, "merged %u EEPROM segments into %u\n", segs->count, n);
+    segs->count = n;
+    return 0;
+}
+
+/*
+ * Predicts how long the boot ROM takes to read the image at the I2C
+ * speed given by the config byte.
+ */
+static void eeprom_report_boot (
+    struct ezusb		*dev,
+    const struct eeprom_image	*img,
+    unsigned			segments,
+    unsigned			khz
+) {
+    unsigned long		clocks;
+
+    clocks = (unsigned long) EEPROM_BYTE_CLOCKS * img->len
+	+ (unsigned long) (EEPROM_SEGMENT_CLOCKS - 4 * EEPROM_BYTE_CLOCKS)
+	    * segments;
+    ezusb_log (dev, "EEPROM boot:  %u bytes, %u segments, about %lu.%lu msec "
+	"at %u KHz\n",
+	img->len, segments,
+	clocks / khz, (clocks % khz) * 10 / khz, khz);
+}
+
+/*
+ * For laying out a boot image in EEPROM format
+ */
+struct eeprom_poke_context {
+    struct ezusb	*dev;
+    struct eeprom_image	*image;
+    unsigned		ee_addr;	/* next free address */
+    int			last;
+    unsigned		page_size;	/* for fragmenting */
+    unsigned		segments;	/* headers written */
+};
+
+/*
+ * EEPROM segments hold at most 1023 bytes.  Bigger ones are fragmented,
+ * ending each piece on a page boundary where that's possible, so the
+ * following header starts a page.
+ */
+#define EEPROM_SEGMENT_MAX	1023
+
+static size_t eeprom_fragment_len (
+    const struct eeprom_poke_context	*ctx,
+    size_t				len
+) {
+    unsigned		end;
+
+    if (len <= EEPROM_SEGMENT_MAX)
+	return len;
+    end = ctx->ee_addr + 4 + EEPROM_SEGMENT_MAX;
+    if (end % ctx->page_size < EEPROM_SEGMENT_MAX)
+	return EEPROM_SEGMENT_MAX - (end % ctx->page_size);
+    return EEPROM_SEGMENT_MAX;
+}
+
+static int eeprom_poke (
+    struct eeprom_poke_context	*ctx,
+    unsigned short		addr,
+    const unsigned char		*data,
+    size_t			len
+) {
+    struct ezusb		*dev = ctx->dev;
+    int				rc;
+    unsigned char		header [4];
+
+    while (len > EEPROM_SEGMENT_MAX) {
+	size_t		n = eeprom_fragment_len (ctx, len);
+	int		last = ctx->last;
+
+	ctx->last = 0;
+	rc = eeprom_poke (ctx, addr, data, n);
+	ctx->last = last;
+	if (rc < 0)
+	    return rc;
+	addr += n;
+	data += n;
+	len -= n;
     }
 
-    if (verbose)
-	logerror("2nd stage:  write boot EEPROM\n");
+    if (ctx->ee_addr + 4 + len > EEPROM_BOOT_MAX) {
+	ezusb_log (dev, "EEPROM boot image can't exceed 64 KB\n");
+	return -ENOSPC;
+    }
+
+    if (dev->verbose >= 2)
+	ezusb_log (dev, "EEPROM segment, addr 0x%04x len %4zd at 0x%04x\n",
+	    addr, len, ctx->ee_addr);
+
+    /* header, then code/data; these share EEPROM pages with each
+     * other and with the previous segment when they're written
+     */
+    header [0] = len >> 8;
+    header [1] = len;
+    header [2] = addr >> 8;
+    header [3] = addr;
+    if (ctx->last)
+	header [0] |= 0x80;
+    if ((rc = eeprom_image_put (dev, ctx->image, ctx->ee_addr, header, 4)) < 0)
+	return rc;
+    if ((rc = eeprom_image_put (dev, ctx->image, ctx->ee_addr + 4, data, len)) < 0)
+	return rc;
+
+    /* next shouldn't overwrite it */
+    ctx->ee_addr += 4 + len;
+    ctx->segments++;
+
+    return 0;
+}
+
+/*
+ * Lays out the boot image for an EEPROM:  the type byte, VID/PID/DID,
+ * config byte, then each segment of the hexfile (if any) preceded by
+ * its header, ending with a write to CPUCS that resets the CPU.  This
+ * doesn't involve the device, so images can be built ahead of time.
+ */
+static int eeprom_build_image (
+    struct ezusb	*dev,
+    struct eeprom_image	*img,
+    const char		*path,		/* hexfile, or NULL */
+    const char		*type,
+    int			config,
+    int			ww_config_vid,
+    int			ww_config_pid
+) {
+    FILE			*image;
+    unsigned short		cpucs_addr;
+    int				(*is_external)(unsigned short off, size_t len);
+    struct eeprom_poke_context	ctx;
+    int				status;
+    unsigned char		value, first_byte;
+    unsigned short ww_vid=0,ww_pid=0;
 
     /* EZ-USB family devices differ, apart from the 8051 core */
     if (strcmp ("fx2", type) == 0) {
@@ -718,11 +1952,10 @@ int ezusb_load_eeprom (int dev, const char *path, const char *type, int config,
 	cpucs_addr = 0xe600;
 	is_external = fx2_is_external;
 	ctx.ee_addr = 8;
-	ctx.eeprom_request = large_eeprom ? RW_EEPROM_LARGE : RW_EEPROM;
 	config &= 0x4f;
 	ww_vid=0x04B4;
 	ww_pid=0x6473;
-	logerror(
+	ezusb_log (dev,
 	    "FX2:  config = 0x%02x, %sconnected, I2C = %d KHz\n",
 	    config,
 	    (config & 0x40) ? "dis" : "",
@@ -737,11 +1970,10 @@ int ezusb_load_eeprom (int dev, const char *path, const char *type, int config,
 	cpucs_addr = 0xe600;
 	is_external = fx2lp_is_external;
 	ctx.ee_addr = 8;
-	ctx.eeprom_request = large_eeprom ? RW_EEPROM_LARGE : RW_EEPROM;
 	config &= 0x4f;
 	ww_vid=0x04B4;
 	ww_pid=0x8613;
-	fprintf (stderr,
+	ezusb_log (dev,
 	    "FX2LP:  type = 0x%02x, config = 0x%02x, %sconnected, I2C = %d KHz\n",
 	    first_byte,
 	    config,
@@ -750,16 +1982,15 @@ int ezusb_load_eeprom (int dev, const char *path, const char *type, int config,
 	    );
     } else if (strcmp ("fx", type) == 0) {
 	if (!path) {
-            logerror("don't know what to do with when onli vid pid flashing");
+            ezusb_log (dev, "don't know what to do with when onli vid pid flashing");
             return -1;
 	}
 	first_byte = 0xB6;
 	cpucs_addr = 0x7f92;
 	is_external = fx_is_external;
 	ctx.ee_addr = 9;
-	ctx.eeprom_request = large_eeprom ? RW_EEPROM_LARGE : RW_EEPROM;
 	config &= 0x07;
-	logerror(
+	ezusb_log (dev,
 	    "FX:  type = 0x%20x, config = 0x%02x, %d MHz%s, I2C = %d KHz\n",
 	    first_byte,
 	    config,
@@ -770,34 +2001,42 @@ int ezusb_load_eeprom (int dev, const char *path, const char *type, int config,
 
     } else if (strcmp ("an21", type) == 0) {
 	if (!path) {
-            logerror("don't know what to do with when only vid pid flashing");
+            ezusb_log (dev, "don't know what to do with when only vid pid flashing");
             return -1;
 	}
 	first_byte = 0xB2;
 	cpucs_addr = 0x7f92;
 	is_external = fx_is_external;
 	ctx.ee_addr = 7;
-	ctx.eeprom_request = large_eeprom ? RW_EEPROM_LARGE : RW_EEPROM;
 	config = 0;
-	logerror("AN21xx:  no EEPROM config byte\n");
+	ezusb_log (dev, "AN21xx:  no EEPROM config byte\n");
 
     } else {
-	logerror("?? Unrecognized microcontroller type %s ??\n", type);
+	ezusb_log (dev, "?? Unrecognized microcontroller type %s ??\n", type);
 	return -1;
     }
 
-    /* make sure the EEPROM won't be used for booting,
-     * in case of problems writing it
-     */
-    value = 0x00;
-    status = ezusb_write (dev, "mark EEPROM as unbootable",
-	    ctx.eeprom_request, 0, &value, sizeof value);
-    if (status < 0)
-	return status;
-
     if(ww_config_vid>=0)  ww_vid=ww_config_vid;
     if(ww_config_pid>=0)  ww_pid=ww_config_pid;
 
+    if (path) {
+        image = fopen (path, "r");
+        if (image == 0) {
+            ezusb_log (dev, "%s: unable to open for input.\n", path);
+            return -2;
+        } else if (dev->verbose)
+            ezusb_log (dev, "open EEPROM hexfile image %s\n", path);
+    } else {
+        image = NULL;
+    }
+
+    if ((status = eeprom_image_init (dev, img)) < 0) {
+	if (image)
+	    fclose (image);
+	return status;
+    }
+    eeprom_image_put (dev, img, 0, &first_byte, 1);
+
     // Load default IDs of an unconfigured FX2 (WW/wolfgang).
     if(ww_vid && ww_pid)
     {
@@ -808,81 +2047,1367 @@ int ezusb_load_eeprom (int dev, const char *path, const char *type, int config,
 	buf[3] = (ww_pid>>8) & 0xffU;
 	buf[4] = 0x05;  // 0xAnnn nnn = chip revision, where first silicon = 001)
 	buf[5] = 0xa0;
-	fprintf (stderr, "Writing vid=0x%04x, pid=0x%04x\n",ww_vid,ww_pid);
-	status = ezusb_write (dev, "load VID, PID", ctx.eeprom_request, 1, buf, 6);
-	if (status < 0)
-	    return status;
+	ezusb_log (dev, "Writing vid=0x%04x, pid=0x%04x\n",ww_vid,ww_pid);
+	eeprom_image_put (dev, img, 1, buf, 6);
     }
 
-    if (path) {
-        /* scan the image, write to EEPROM */
-        ctx.device = dev;
-        ctx.last = 0;
-        status = parse_ihex (image, &ctx, is_external, eeprom_poke);
-        if (status < 0) {
-            logerror("unable to write EEPROM %s\n", path);
-            return status;
-        }
-
-        /* append a reset command */
-        value = 0;
-        ctx.last = 1;
-        status = eeprom_poke (&ctx, cpucs_addr, 0, &value, sizeof value);
-        if (status < 0) {
-            logerror("unable to append reset to EEPROM %s\n", path);
-            return status;
-        }
-    }
-
-    /* write the config byte for FX, FX2 */
+    /* the config byte for FX, FX2 */
     if (strcmp ("an21", type) != 0) {
 	value = config;
-	status = ezusb_write (dev, "write config byte",
-		ctx.eeprom_request, 7, &value, sizeof value);
-	if (status < 0)
-	    return status;
+	eeprom_image_put (dev, img, 7, &value, sizeof value);
     }
 
     /* EZ-USB FX has a reserved byte */
     if (strcmp ("fx", type) == 0) {
 	value = 0;
-	status = ezusb_write (dev, "write reserved byte",
-		ctx.eeprom_request, 8, &value, sizeof value);
-	if (status < 0)
-	    return status;
+	eeprom_image_put (dev, img, 8, &value, sizeof value);
     }
 
-    /* make the EEPROM say to boot from this EEPROM */
+    if (image) {
+	struct eeprom_segments	segs = { dev };
+	unsigned		i;
+
+        /* scan the image */
+        status = parse_ihex (dev, image, &segs, is_external, eeprom_collect);
+        fclose (image);
+        if (status < 0) {
+            ezusb_log (dev, "unable to write EEPROM %s\n", path);
+	    eeprom_segments_free (&segs);
+            goto fail;
+        }
+
+	status = eeprom_optimize (dev, &segs, dev->merge_gap, is_external);
+	if (status < 0) {
+	    eeprom_segments_free (&segs);
+	    goto fail;
+	}
+
+	ctx.dev = dev;
+	ctx.image = img;
+	ctx.last = 0;
+	ctx.page_size = (dev->page_size > 0) ? dev->page_size : 32;
+	ctx.segments = 0;
+	for (i = 0; i < segs.count; i++) {
+	    status = eeprom_poke (&ctx, segs.seg [i].addr,
+		    segs.seg [i].data, segs.seg [i].len);
+	    if (status < 0)
+		break;
+	}
+	eeprom_segments_free (&segs);
+        if (status < 0) {
+            ezusb_log (dev, "unable to write EEPROM %s\n", path);
+            goto fail;
+        }
+
+        /* append a reset command */
+        value = 0;
+        ctx.last = 1;
+        status = eeprom_poke (&ctx, cpucs_addr, &value, sizeof value);
+        if (status < 0) {
+            ezusb_log (dev, "unable to append reset to EEPROM %s\n", path);
+            goto fail;
+        }
+
+	if (dev->verbose || dev->merge_gap > 0)
+	    eeprom_report_boot (dev, img, ctx.segments,
+		    (strcmp ("an21", type) != 0 && (config & 0x01))
+			? 400 : 100);
+    }
+    return 0;
+
+fail:
+    eeprom_image_free (img);
+    return status;
+}
+
+/*
+ * An optional journal on the host records which pages of the boot image
+ * were written and verified, so that if programming is interrupted (lost
+ * power, a bumped cable) rerunning with the same image resumes where it
+ * stopped instead of rewriting everything.  It's a small header naming
+ * the image, then one byte per EEPROM page, set once that page checks
+ * out; it's removed once the type byte has been written.
+ */
+
+/* pages written between journal updates */
+#define EEPROM_JOURNAL_PAGES	32
+
+struct eeprom_journal_header {
+    char			magic [8];
+    unsigned			hash;
+    unsigned			len;
+    unsigned			page_size;
+    unsigned			npages;
+};
+
+static const char eeprom_journal_magic [8] = "fxloadJ1";
+
+struct eeprom_journal {
+    int				fd;
+    unsigned			npages;
+};
+
+static unsigned eeprom_image_hash (const struct eeprom_image *img)
+{
+    unsigned			hash = 2166136261u;	/* FNV-1a */
+    unsigned			i;
+
+    for (i = 0; i < img->len; i++) {
+	hash = (hash ^ (img->valid [i] ? img->data [i] : 0x100)) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Opens the journal.  If it describes this image, the pages it records
+ * as done are flagged in "done"; otherwise it's (re)started, empty.
+ * Returns the number of pages already done, else negative errno.
+ */
+static int eeprom_journal_open (
+    struct ezusb		*dev,
+    struct eeprom_journal	*j,
+    const char			*path,
+    const struct eeprom_image	*img,
+    unsigned			page_size,
+    unsigned			npages,
+    unsigned char		*done
+) {
+    struct eeprom_journal_header	hdr, old;
+    unsigned			i;
+    int				count = 0;
+
+    j->npages = npages;
+    j->fd = open (path, O_RDWR | O_CREAT, 0644);
+    if (j->fd < 0) {
+	ezusb_log (dev, "%s: can't open journal, %s\n", path, strerror (errno));
+	return -errno;
+    }
+
+    memset (&hdr, 0, sizeof hdr);
+    memcpy (hdr.magic, eeprom_journal_magic, sizeof hdr.magic);
+    hdr.hash = eeprom_image_hash (img);
+    hdr.len = img->len;
+    hdr.page_size = page_size;
+    hdr.npages = npages;
+
+    memset (done, 0, npages);
+    if (pread (j->fd, &old, sizeof old, 0) == sizeof old
+	    && memcmp (&old, &hdr, sizeof hdr) == 0
+	    && pread (j->fd, done, npages, sizeof hdr) == (ssize_t) npages) {
+	for (i = 0; i < npages; i++) {
+	    done [i] = (done [i] == 1);
+	    count += done [i];
+	}
+	return count;
+    }
+
+    /* start over; a crash before this is all on disk just means
+     * the next run starts over too
+     */
+    memset (done, 0, npages);
+    if (ftruncate (j->fd, 0) < 0
+	    || pwrite (j->fd, done, npages, sizeof hdr) != (ssize_t) npages
+	    || pwrite (j->fd, &hdr, sizeof hdr, 0) != sizeof hdr
+	    || fdatasync (j->fd) < 0) {
+	ezusb_log (dev, "%s: can't write journal, %s\n", path, strerror (errno));
+	close (j->fd);
+	j->fd = -1;
+	return -EIO;
+    }
+    return 0;
+}
+
+/* records pages [first, last) as written and verified */
+static int eeprom_journal_mark (
+    struct ezusb		*dev,
+    struct eeprom_journal	*j,
+    unsigned			first,
+    unsigned			last
+) {
+    unsigned char		marks [EEPROM_JOURNAL_PAGES];
+    unsigned			n;
+
+    memset (marks, 1, sizeof marks);
+    while (first < last) {
+	n = last - first;
+	if (n > sizeof marks)
+	    n = sizeof marks;
+	if (pwrite (j->fd, marks, n,
+		sizeof (struct eeprom_journal_header) + first) != (ssize_t) n)
+	    goto fail;
+	first += n;
+    }
+    if (fdatasync (j->fd) == 0)
+	return 0;
+fail:
+    ezusb_log (dev, "can't update journal, %s\n", strerror (errno));
+    return -EIO;
+}
+
+/*
+ * Writes and then checks the flagged pages.  Failing pages are
+ * rewritten, up to RETRY_LIMIT times; returns the number of pages
+ * written the first time, else negative errno.
+ */
+static int eeprom_write_verify (
+    struct eeprom_writer	*w,
+    const struct eeprom_image	*img,
+    unsigned char		*old,
+    unsigned char		*readback,
+    unsigned char		*pages
+) {
+    struct ezusb		*dev = w->dev;
+    unsigned			retry;
+    int				status, written;
+
+    written = eeprom_write_image (w, img, old, pages);
+    if (written < 0 || !readback)
+	return written;
+
+    for (retry = 0; ; retry++) {
+	status = eeprom_verify_image (dev, w->request,
+		w->page_size, img, pages, readback);
+	if (status <= 0)
+	    break;
+	if (retry == RETRY_LIMIT) {
+	    ezusb_log (dev, "EEPROM verify failed, %d pages differ\n", status);
+	    return -EIO;
+	}
+	ezusb_log (dev, "EEPROM verify:  rewriting %d pages\n", status);
+	status = eeprom_write_image (w, img, old, pages);
+	if (status < 0)
+	    break;
+    }
+    return (status < 0) ? status : written;
+}
+
+/*
+ * Writes a boot image into the EEPROM.  The type byte is cleared first,
+ * so a partial write won't be booted, and is written last.
+ */
+static void eeprom_size_range (struct ezusb *dev, int large_eeprom,
+	unsigned *min, unsigned *max);
+static int eeprom_detect_size (struct ezusb *dev, unsigned char request,
+	int large_eeprom, int probe, int *confirmed);
+
+/* page write cycles for one transfer of len bytes at addr */
+static unsigned eeprom_pages (unsigned page_size, unsigned addr, unsigned len)
+{
+    if (len == 0)
+	return 0;
+    return (addr + len - 1) / page_size - addr / page_size + 1;
+}
+
+/*
+ * What the boot image would cost written the unbuffered way:  the IDs
+ * and config byte, then each segment's header and data, each as its
+ * own transfer without regard to page boundaries.  Compared with the
+ * page writes actually issued, that's what the page aligned writer
+ * saves.  Returns zero for images that aren't boot images.
+ */
+static unsigned eeprom_unaligned_writes (
+    const struct eeprom_image	*img,
+    unsigned			page_size
+) {
+    unsigned			addr, len, writes;
+
+    switch (img->data [0]) {
+    case 0xC2:
+	addr = 8;
+	break;
+    case 0xB6:
+	addr = 9;
+	break;
+    case 0xB2:
+	addr = 7;
+	break;
+    default:
+	return 0;
+    }
+    writes = eeprom_pages (page_size, 1, addr - 1);
+    while (addr + 4 <= img->len) {
+	len = ((img->data [addr] & 0x03) << 8) | img->data [addr + 1];
+	writes += eeprom_pages (page_size, addr, 4)
+	    + eeprom_pages (page_size, addr + 4, len);
+	if (img->data [addr] & 0x80)
+	    break;
+	addr += 4 + len;
+    }
+    return writes;
+}
+
+static int eeprom_program_image (
+    struct ezusb			*dev,
+    unsigned char		eeprom_request,
+    unsigned			page_size,
+    const struct eeprom_image	*img,
+    int				flags
+) {
+    struct eeprom_writer	writer;
+    unsigned char		*old = NULL;
+    unsigned char		*pages = NULL, *batch;
+    unsigned char		*readback = NULL;
+    struct eeprom_journal	journal = { -1, 0 };
+    unsigned			npages, stride, first, last, i;
+    unsigned			min, max;
+    int				status, written = 0, confirmed;
+    int				large = eeprom_request == RW_EEPROM_LARGE;
+    unsigned char		value, first_byte = img->data [0];
+
+    eeprom_writer_init (&writer, dev, eeprom_request, page_size);
+    if (dev->verbose)
+	ezusb_log (dev, "EEPROM page size %u\n", writer.page_size);
+
+    /* the part ignores address bits it doesn't have, and so do loaders
+     * that ignore wIndex; anything past its end would overwrite the
+     * boot header, so check before writing anything.  Reading can't tell
+     * the end of the part from a second copy of the image, so when the
+     * image could be too big the size is probed, and it's only refused
+     * if that confirms the part wraps.
+     */
+    eeprom_size_range (dev, large, &min, &max);
+    status = eeprom_detect_size (dev, eeprom_request, large,
+	    img->len > min, &confirmed);
+    if (status < 0)
+	goto done;
+    if (img->len > (unsigned) status) {
+	if (confirmed) {
+	    ezusb_log (dev, "EEPROM image is %u bytes, the part only %d\n",
+		img->len, status);
+	    status = -EFBIG;
+	    goto done;
+	}
+	ezusb_log (dev, "warning: EEPROM image is %u bytes, "
+	    "the part may be only %d\n", img->len, status);
+    }
+
+    /* for updates, only pages that differ from the current
+     * EEPROM contents need to be written
+     */
+    if (flags & EZUSB_EEPROM_UPDATE) {
+	old = malloc (img->len);
+	if (!old) {
+	    status = -ENOMEM;
+	    goto done;
+	}
+	status = eeprom_read (dev, eeprom_request, 0, old, img->len);
+	if (status < 0) {
+	    ezusb_log (dev, "can't read EEPROM for update\n");
+	    goto done;
+	}
+	for (i = 0; i < img->len; i++) {
+	    if (img->valid [i] && old [i] != img->data [i])
+		break;
+	}
+	if (i == img->len) {
+	    if (dev->verbose)
+		ezusb_log (dev, "EEPROM is already up to date\n");
+	    status = 0;
+	    goto done;
+	}
+    }
+
+    /* make sure the EEPROM won't be used for booting,
+     * in case of problems writing it
+     */
+    if (!old || old [0] != 0x00) {
+	value = 0x00;
+	status = ezusb_write (dev, "mark EEPROM as unbootable",
+		eeprom_request, 0, &value, sizeof value);
+	if (status < 0)
+	    goto done;
+    }
+
+    npages = (img->len + writer.page_size - 1) / writer.page_size;
+    pages = malloc (2 * npages);
+    if (!pages) {
+	status = -ENOMEM;
+	goto done;
+    }
+    batch = pages + npages;
+    memset (pages, 1, npages);
+
+    /* pages only count as done once they've been read back; that's
+     * never taken for the old contents, which only an update reads
+     */
+    if ((flags & EZUSB_EEPROM_VERIFY) || dev->journal) {
+	readback = malloc (img->len);
+	if (!readback) {
+	    status = -ENOMEM;
+	    goto done;
+	}
+    }
+
+    /* resuming:  recheck what the journal says was done, since
+     * this might not be the same EEPROM; that's only reads
+     */
+    if (dev->journal) {
+	status = eeprom_journal_open (dev, &journal, dev->journal, img,
+		writer.page_size, npages, batch);
+	if (status < 0)
+	    goto done;
+	if (status > 0) {
+	    if (dev->verbose)
+		ezusb_log (dev, "journal: %d of %u pages already written\n",
+		    status, npages);
+	    for (i = 0; i < npages; i++)
+		pages [i] = !batch [i];
+	    status = eeprom_verify_image (dev, eeprom_request,
+		    writer.page_size, img, batch, readback);
+	    if (status < 0)
+		goto done;
+	    if (status > 0)
+		ezusb_log (dev, "journal: %d pages need rewriting\n", status);
+	    for (i = 0; i < npages; i++)
+		pages [i] |= batch [i];
+	}
+	stride = EEPROM_JOURNAL_PAGES;
+    } else
+	stride = npages;
+
+    for (i = first = 0; i < npages; i++) {
+	if (pages [i])
+	    first++;
+    }
+    progress_begin (dev, EZUSB_PROGRESS_EEPROM,
+	    (unsigned long) first * writer.page_size);
+
+    /* write and check a batch at a time, so the journal keeps up */
+    for (first = 0; first < npages; first = last) {
+	last = first + stride;
+	if (last > npages)
+	    last = npages;
+	memset (batch, 0, npages);
+	memcpy (batch + first, pages + first, last - first);
+	for (i = first; i < last && !batch [i]; i++)
+	    continue;
+	if (i == last)
+	    continue;
+
+	status = eeprom_write_verify (&writer, img, old, readback, batch);
+	if (status < 0)
+	    goto done;
+	written += status;
+
+	if (journal.fd >= 0) {
+	    status = eeprom_journal_mark (dev, &journal, first, last);
+	    if (status < 0)
+		goto done;
+	}
+    }
+
+    if (dev->verbose) {
+	ezusb_log (dev, "... WROTE: %u bytes, %u page writes",
+	    writer.total, writer.writes);
+	if (!old && (i = eeprom_unaligned_writes (img, writer.page_size)))
+	    ezusb_log (dev, " (%u if unaligned)", i);
+	if (npages != (unsigned) written)
+	    ezusb_log (dev, ", %u of %u pages unchanged", npages - written, npages);
+	ezusb_log (dev, "\n");
+	if (readback)
+	    ezusb_log (dev, "... VERIFIED: %u bytes\n", img->len - 1);
+    }
+
+    /* make the EEPROM say to boot from this EEPROM */
     status = ezusb_write (dev, "write EEPROM type byte",
-	    ctx.eeprom_request, 0, &first_byte, sizeof first_byte);
+	    eeprom_request, 0, &first_byte, sizeof first_byte);
+    if (status < 0)
+	goto done;
+    status = 0;
+
+    if (readback) {
+	status = eeprom_read (dev, eeprom_request, 0, &value, 1);
+	if (status == 0 && value != first_byte) {
+	    ezusb_log (dev, "EEPROM verify failed, type byte 0x%02x\n", value);
+	    status = -EIO;
+	}
+    }
+    if (status == 0 && journal.fd >= 0)
+	unlink (dev->journal);
+    if (status == 0)
+	progress_end (dev, EZUSB_PROGRESS_EEPROM);
+
+done:
+    if (journal.fd >= 0)
+	close (journal.fd);
+    free (pages);
+    free (readback);
+    free (old);
+    return status;
+}
+
+/*
+ * Load an Intel HEX file into target (large) EEPROM, set up to boot from
+ * that EEPROM using the specified microcontroller-specific config byte.
+ * (Defaults:  FX2 0x08, FX 0x00, AN21xx n/a)
+ *
+ * Caller must have pre-loaded a second stage loader that knows how
+ * to handle the EEPROM write requests.
+ */
+int ezusb_load_eeprom (struct ezusb *dev, const char *path, const char *type, int config, int large_eeprom,
+	int ww_config_vid,int ww_config_pid, int flags)
+{
+    struct eeprom_image		img;
+    unsigned char		value;
+    int				status;
+
+    if (path) {
+	if ((status=ezusb_get_eeprom_type (dev, &value)) != 1 || value != 1) {
+            ezusb_log (dev, "don't see a large enough EEPROM, status=%d, val=%d%s\n",
+                     status,value,value==0 ? " (ignored)" : "");
+            if(value!=0) return -1;
+	}
+    }
+
+    if (dev->verbose)
+	ezusb_log (dev, "2nd stage:  write boot EEPROM\n");
+
+    status = eeprom_build_image (dev, &img, path, type, config,
+	    ww_config_vid, ww_config_pid);
     if (status < 0)
 	return status;
 
+    status = eeprom_program_image (dev,
+	    large_eeprom ? RW_EEPROM_LARGE : RW_EEPROM,
+	    eeprom_choose_page_size (dev, large_eeprom), &img, flags);
+
     /* Note:  VID/PID/version aren't written.  They should be
      * written if the EEPROM type is modified (to B4 or C0).
      */
 
-    return 0;
+    eeprom_image_free (&img);
+    return status;
+}
+
+/*
+ * Builds the EEPROM boot image without a device, saving it as a raw
+ * (Cypress ".iic") file.  Bytes the image doesn't define are 0xff.
+ */
+int ezusb_build_eeprom (struct ezusb *dev, const char *path, const char *type, int config,
+	int ww_config_vid, int ww_config_pid, const char *out)
+{
+    struct eeprom_image		img;
+    unsigned			i;
+    FILE			*f;
+    int				status;
+
+    status = eeprom_build_image (dev, &img, path, type, config,
+	    ww_config_vid, ww_config_pid);
+    if (status < 0)
+	return status;
+
+    for (i = 0; i < img.len; i++) {
+	if (!img.valid [i])
+	    img.data [i] = 0xff;
+    }
+
+    f = fopen (out, "w");
+    if (!f) {
+	ezusb_log (dev, "%s: unable to open for output.\n", out);
+	status = -2;
+    } else {
+	if (fwrite (img.data, 1, img.len, f) != img.len)
+	    status = -EIO;
+	if (fclose (f) != 0)
+	    status = -EIO;
+	if (status < 0)
+	    ezusb_log (dev, "%s: write error\n", out);
+	else if (dev->verbose)
+	    ezusb_log (dev, "... BUILT: %u byte EEPROM image, type 0x%02x\n",
+		img.len, img.data [0]);
+    }
+
+    eeprom_image_free (&img);
+    return status;
+}
+
+/*
+ * Writes a prebuilt raw (".iic") boot image into the EEPROM, in whole
+ * pages, with the type byte written last.
+ */
+int ezusb_flash_eeprom (struct ezusb *dev, const char *path, int large_eeprom,
+	int flags)
+{
+    struct eeprom_image		img;
+    FILE			*f;
+    size_t			len;
+    int				status;
+
+    f = fopen (path, "r");
+    if (!f) {
+	ezusb_log (dev, "%s: unable to open for input.\n", path);
+	return -2;
+    }
+    if ((status = eeprom_image_init (dev, &img)) < 0) {
+	fclose (f);
+	return status;
+    }
+    len = fread (img.data, 1, EEPROM_IMAGE_MAX, f);
+    if (ferror (f) || len == 0 || fgetc (f) != EOF) {
+	ezusb_log (dev, "%s: not a usable EEPROM image\n", path);
+	fclose (f);
+	eeprom_image_free (&img);
+	return -EINVAL;
+    }
+    fclose (f);
+
+    img.len = len;
+    memset (img.valid, 1, len);
+    if (dev->verbose)
+	ezusb_log (dev, "open EEPROM image %s, %zd bytes, type 0x%02x\n",
+	    path, len, img.data [0]);
+
+    status = eeprom_program_image (dev,
+	    large_eeprom ? RW_EEPROM_LARGE : RW_EEPROM,
+	    eeprom_choose_page_size (dev, large_eeprom), &img, flags);
+    eeprom_image_free (&img);
+    return status;
+}
+
+/*
+ * Returns where the boot image in the first "have" bytes of an EEPROM
+ * ends, walking segment headers for the C2/B6/B2 formats.  Sets *known
+ * once that's certain; otherwise the rest of the part may be used.
+ */
+static unsigned eeprom_content_end (
+    const unsigned char	*data,
+    unsigned		have,
+    unsigned		size,
+    int			*known
+) {
+    unsigned		off, len;
+
+    *known = 0;
+    if (have < 1)
+	return size;
+
+    switch (data [0]) {
+    case 0xC0:			/* FX2 VID/PID/DID, config */
+	*known = 1;
+	return 8;
+    case 0xB4:			/* FX VID/PID/DID, config, reserved */
+	*known = 1;
+	return 9;
+    case 0xB0:			/* AN21 VID/PID/DID */
+	*known = 1;
+	return 7;
+    case 0xC2:
+	off = 8;
+	break;
+    case 0xB6:
+	off = 9;
+	break;
+    case 0xB2:
+	off = 7;
+	break;
+    default:			/* not bootable; take everything */
+	*known = 1;
+	return size;
+    }
+
+    while (off + 4 <= have) {
+	len = ((data [off] & 0x03) << 8) | data [off + 1];
+	if (data [off] & 0x80) {
+	    *known = 1;
+	    return off + 4 + len;
+	}
+	off += 4 + len;
+	if (off >= size) {
+	    *known = 1;
+	    return size;
+	}
+    }
+    return size;
+}
+
+/*
+ * Writes data as Intel HEX, sixteen bytes per record, with extended
+ * linear address records for anything past 64 KB.
+ */
+static int write_ihex (FILE *f, const unsigned char *data, unsigned len)
+{
+    unsigned		off, i, n;
+    unsigned char	sum;
+
+    for (off = 0; off < len; off += n) {
+	n = len - off;
+	if (n > 16)
+	    n = 16;
+	if (off != 0 && (off & 0xffff) == 0) {
+	    sum = 2 + 4 + (off >> 24) + (off >> 16);
+	    fprintf (f, ":02000004%04X%02X\n", off >> 16,
+		(unsigned char) -sum);
+	}
+	sum = n + (off >> 8) + off;
+	fprintf (f, ":%02X%04X00", n, off & 0xffff);
+	for (i = 0; i < n; i++) {
+	    fprintf (f, "%02X", data [off + i]);
+	    sum += data [off + i];
+	}
+	fprintf (f, "%02X\n", (unsigned char) -sum);
+    }
+    fputs (":00000001FF\n", f);
+    return ferror (f) ? -EIO : 0;
+}
+
+/*
+ * Returns the EEPROM size.  GET_EEPROM_SIZE only says whether the part
+ * uses 8 or 16 bit addresses; within that, parts ignore the address bits
+ * they don't have, so reading past the end wraps around to the start.
+ * A block at some power of two that matches the block at zero probably
+ * marks the end of the part, but may just be a second copy of the image.
+ * If "probe" is set, that's confirmed by briefly changing a byte at the
+ * start and looking for the change, and *confirmed is set.  Without it
+ * nothing is written; blank (or otherwise uniform) data matches
+ * everywhere, so then the largest size addressing allows is returned.
+ */
+#define EEPROM_PROBE_LEN	16
+
+/* the smallest and largest sizes a part could be */
+static void eeprom_size_range (struct ezusb *dev, int large_eeprom,
+	unsigned *min, unsigned *max)
+{
+    unsigned char	value = 0;
+
+    if (!large_eeprom && ezusb_get_eeprom_type (dev, &value) == 1
+	    && value == 0) {
+	*min = 0x80;
+	*max = 0x100;
+    } else {
+	*min = 0x1000;
+	*max = EEPROM_IMAGE_MAX;
+    }
 }
 
+static int eeprom_detect_size (
+    struct ezusb		*dev,
+    unsigned char	request,
+    int			large_eeprom,
+    int			probe,
+    int			*confirmed
+) {
+    unsigned char	base [EEPROM_PROBE_LEN], buf [EEPROM_PROBE_LEN];
+    unsigned char	value;
+    unsigned		size, max, i;
+    int			status, found = 0;
+
+    if (confirmed)
+	*confirmed = 0;
+    eeprom_size_range (dev, large_eeprom, &size, &max);
+
+    /* loaders which ignore wIndex wrap at 64 KB too */
+
+    status = eeprom_read (dev, request, 0, base, sizeof base);
+    if (status < 0)
+	return status;
+    for (i = 1; i < sizeof base && base [i] == base [0]; i++)
+	continue;
+    /* blank data matches anywhere; without writing, assume the most */
+    if (i == sizeof base && !probe)
+	size = max;
+
+    /* an 8 bit part wraps at "max" itself */
+    for (; size <= max; size <<= 1) {
+	status = eeprom_read (dev, request, size, buf, sizeof buf);
+	if (status < 0)
+	    return status;
+	if (memcmp (base, buf, sizeof buf) != 0)
+	    continue;
+	if (!probe) {
+	    found = 1;
+	    break;
+	}
+
+	/* the last probe byte is never the type byte */
+	value = ~base [EEPROM_PROBE_LEN - 1];
+	status = ezusb_write (dev, "probe EEPROM size", request,
+		EEPROM_PROBE_LEN - 1, &value, 1);
+	if (status < 0)
+	    return status;
+	status = eeprom_read (dev, request, size + EEPROM_PROBE_LEN - 1,
+		buf, 1);
+	if (ezusb_write (dev, "restore EEPROM", request,
+		    EEPROM_PROBE_LEN - 1, base + EEPROM_PROBE_LEN - 1, 1) < 0)
+	    return -EIO;
+	if (status < 0)
+	    return status;
+	if (buf [0] == value) {
+	    found = 1;
+	    if (confirmed)
+		*confirmed = 1;
+	    break;
+	}
+    }
+    if (!found)
+	size = max;
+    if (dev->verbose)
+	ezusb_log (dev, "EEPROM size %u bytes%s\n", size,
+	    (probe && found) ? "" : " (not confirmed)");
+    return size;
+}
+
+/*
+ * Picks the page size for erasing a part of this size, as typical
+ * for 24LCxx parts:  larger parts have larger pages.
+ */
+static unsigned eeprom_page_size_for (struct ezusb *dev, unsigned size)
+{
+    if (dev->page_size > 0)
+	return dev->page_size;
+    if (size <= 0x100)
+	return 8;
+    if (size <= 0x2000)
+	return 32;
+    if (size <= 0x8000)
+	return 64;
+    return 128;
+}
+
+int ezusb_eeprom_size (struct ezusb *dev, int large_eeprom)
+{
+    return eeprom_detect_size (dev,
+	    large_eeprom ? RW_EEPROM_LARGE : RW_EEPROM, large_eeprom, 0, NULL);
+}
+
+int ezusb_dump_eeprom (struct ezusb *dev, const char *path, int large_eeprom)
+{
+    unsigned char	*data;
+    unsigned char	request;
+    unsigned		size;
+    const char		*suffix;
+    FILE		*f;
+    int			status;
+
+    request = large_eeprom ? RW_EEPROM_LARGE : RW_EEPROM;
+    status = eeprom_detect_size (dev, request, large_eeprom, 0, NULL);
+    if (status < 0) {
+	ezusb_log (dev, "unable to read EEPROM\n");
+	return status;
+    }
+    size = status;
+
+    data = malloc (size);
+    if (!data)
+	return -ENOMEM;
+    progress_begin (dev, EZUSB_PROGRESS_READ, size);
+    status = eeprom_read_until (dev, request,
+	    0, data, size, eeprom_content_end);
+    if (status < 0) {
+	ezusb_log (dev, "unable to read EEPROM\n");
+	goto done;
+    }
+    progress_end (dev, EZUSB_PROGRESS_READ);
+    if (dev->verbose)
+	ezusb_log (dev, "... READ: %d bytes, boot type 0x%02x\n", status, data [0]);
+
+    f = fopen (path, "w");
+    if (!f) {
+	ezusb_log (dev, "%s: unable to open for output.\n", path);
+	status = -2;
+	goto done;
+    }
+    suffix = strrchr (path, '.');
+    if (suffix && (strcmp (suffix, ".hex") == 0
+		|| strcmp (suffix, ".ihx") == 0))
+	status = write_ihex (f, data, status);
+    else if (fwrite (data, 1, status, f) != status)
+	status = -EIO;
+    else
+	status = 0;
+    if (fclose (f) != 0 && status == 0)
+	status = -EIO;
+    if (status < 0)
+	ezusb_log (dev, "%s: write error\n", path);
+
+done:
+    free (data);
+    return status;
+}
 
-int ezusb_erase_eeprom (int dev, int large_eeprom)
+/*
+ * Overwrites the EEPROM with 0xff, a page at a time.  Normally that
+ * covers the whole part, but with EZUSB_EEPROM_ERASE_USED only the
+ * area used by the current boot image (if any) is erased; that starts
+ * with the type byte, so the part stops booting immediately.
+ */
+int ezusb_erase_eeprom (struct ezusb *dev, int large_eeprom, int flags)
 {
-    int	status;
-    int adr;
-    unsigned char buf[32];
+    struct eeprom_writer	writer;
+    unsigned char		request;
+    int				status;
+    unsigned			adr, size, end;
+    unsigned char		buf [EEPROM_PAGE_MAX];
+
+    request = large_eeprom ? RW_EEPROM_LARGE : RW_EEPROM;
+    status = eeprom_detect_size (dev, request, large_eeprom,
+	    !(flags & EZUSB_EEPROM_ERASE_USED), NULL);
+    if (status < 0)
+	return status;
+    size = end = status;
+
+    memset(buf,0xff,sizeof buf);
+    eeprom_writer_init (&writer, dev, request, eeprom_page_size_for (dev, size));
 
-    memset(buf,0xff,32);
+    if (flags & EZUSB_EEPROM_ERASE_USED) {
+	unsigned char		*data = malloc (size);
 
-    // Assume EEPROM size of 8k (24LC64).
-    for(adr=0; adr<8192; adr+=32)
+	if (!data)
+	    return -ENOMEM;
+	status = eeprom_read_until (dev, request, 0, data, size,
+		eeprom_content_end);
+	free (data);
+	if (status < 0)
+	    return status;
+	end = status;
+    }
+    if (dev->verbose)
+	ezusb_log (dev, "erase EEPROM 0x0000..0x%05x, page size %u\n",
+	    end, writer.page_size);
+
+    progress_begin (dev, EZUSB_PROGRESS_EEPROM,
+	    (end + writer.page_size - 1) / writer.page_size * writer.page_size);
+    for(adr=0; adr<end; adr+=writer.page_size)
     {
-	status = ezusb_write (dev, "overwrite EEPROM with 0xff",
-	    large_eeprom ? RW_EEPROM_LARGE : RW_EEPROM, adr, buf, 32);
+	status = eeprom_stream (&writer, adr, buf, writer.page_size);
 	if (status < 0)
 	    return status;
     }
 
+    status = eeprom_flush (&writer);
+    if (status == 0)
+	progress_end (dev, EZUSB_PROGRESS_EEPROM);
+    return status;
+}
+
+/*
+ * Stops the EEPROM from being used for booting, by overwriting just its
+ * type byte (and maybe the first segment header) with 0xff, as on an
+ * erased part.  That's a couple of transfers and write cycles, instead
+ * of rewriting the whole part.  What was written is read back.
+ */
+int ezusb_invalidate_eeprom (struct ezusb *dev, int large_eeprom, int flags)
+{
+    unsigned char	request;
+    unsigned char	buf [16], check [16];
+    unsigned		len = 1, header = 0;
+    int			status;
+
+    request = large_eeprom ? RW_EEPROM_LARGE : RW_EEPROM;
+    status = eeprom_read (dev, request, 0, buf, sizeof buf);
+    if (status < 0) {
+	ezusb_log (dev, "unable to read EEPROM\n");
+	return status;
+    }
+
+    switch (buf [0]) {
+    case 0xC2:
+	header = 8;
+	break;
+    case 0xB6:
+	header = 9;
+	break;
+    case 0xB2:
+	header = 7;
+	break;
+    case 0xC0:
+    case 0xB4:
+    case 0xB0:
+	break;
+    default:
+	if (dev->verbose)
+	    ezusb_log (dev, "EEPROM type 0x%02x isn't bootable\n", buf [0]);
+	return 0;
+    }
+
+    /* type byte first; it's what matters */
+    buf [0] = 0xff;
+    status = ezusb_write (dev, "invalidate EEPROM type byte",
+	    request, 0, buf, 1);
+    if (status < 0)
+	return status;
+
+    if (header && (flags & EZUSB_EEPROM_INVALIDATE_HEADER)) {
+	memset (buf + header, 0xff, 4);
+	status = ezusb_write (dev, "invalidate EEPROM segment header",
+		request, header, buf + header, 4);
+	if (status < 0)
+	    return status;
+	len = header + 4;
+    }
+
+    status = eeprom_read (dev, request, 0, check, len);
+    if (status < 0)
+	return status;
+    if (memcmp (buf, check, len) != 0) {
+	ezusb_log (dev, "EEPROM still bootable, type 0x%02x\n", check [0]);
+	return -EIO;
+    }
     return 0;
 }
 
+/*****************************************************************************/
+
+/*
+ * Asynchronous RAM loads, so one thread can drive many devices from its
+ * event loop.  The writes ezusb_load_image() would issue are planned up
+ * front, then queued with usbfs a few at a time.  EP0 handles them in
+ * order.  CPUCS writes are issued alone, so nothing is written after
+ * one fails, and the CPU is never started after a failed write.
+ */
+#define ASYNC_DEPTH	4
+
+struct async_op {
+    unsigned char	request;	/* RW_INTERNAL or RW_MEMORY */
+    unsigned short	addr;
+    const unsigned char	*data;		/* in the image; NULL for CPUCS */
+    unsigned		len;
+    unsigned char	cpucs;		/* value written to CPUCS */
+};
+
+struct ezusb_async {
+    struct ezusb	*dev;
+    int			status;		/* -EINPROGRESS until done */
+
+    struct async_op	*op;
+    unsigned		count, alloc;
+    unsigned		next;		/* first op not yet submitted */
+    unsigned		pending;	/* submitted, not yet reaped */
+    unsigned		acked;		/* ops completed, in order */
+    unsigned		retries;	/* since the last completion */
+    unsigned		total;		/* bytes written */
+    long long		progress;	/* msec, last submit or completion */
+
+    void		(*done) (struct ezusb_async *job, int status,
+				void *arg);
+    void		*arg;
+
+    struct ctrl_urb	urbs [ASYNC_DEPTH];
+};
+
+static int async_add (
+    struct ezusb_async	*job,
+    unsigned char	request,
+    unsigned short	addr,
+    const unsigned char	*data,
+    unsigned		len
+) {
+    struct async_op	*op;
+
+    if (job->count == job->alloc) {
+	unsigned	alloc = job->alloc ? 2 * job->alloc : 32;
+
+	op = realloc (job->op, alloc * sizeof *op);
+	if (!op)
+	    return -ENOMEM;
+	job->op = op;
+	job->alloc = alloc;
+    }
+    op = &job->op [job->count++];
+    op->request = request;
+    op->addr = addr;
+    op->data = data;
+    op->len = len;
+    op->cpucs = 0;
+    return 0;
+}
+
+static int async_add_cpucs (struct ezusb_async *job, unsigned short addr,
+	int doRun)
+{
+    int			status;
+
+    status = async_add (job, RW_INTERNAL, addr, NULL, 1);
+    if (status == 0)
+	job->op [job->count - 1].cpucs = doRun ? 0 : 1;
+    return status;
+}
+
+/* the same writes, in the same order, as ezusb_load_image() */
+static int async_plan (
+    struct ezusb_async		*job,
+    const struct ezusb_image	*image,
+    int				fx2,
+    int				stage
+) {
+    unsigned short		cpucs_addr;
+    int				(*is_external)(unsigned short off, size_t len);
+    unsigned			i;
+    int				status = 0;
+
+    if (fx2 == 2) {
+	cpucs_addr = 0xe600;
+	is_external = fx2lp_is_external;
+    } else if (fx2) {
+	cpucs_addr = 0xe600;
+	is_external = fx2_is_external;
+    } else {
+	cpucs_addr = 0x7f92;
+	is_external = fx_is_external;
+    }
+
+    /* without a second stage loader, only on-chip RAM can be written */
+    if (stage) {
+	for (i = 0; i < image->count && status == 0; i++) {
+	    const struct ram_segment	*seg = &image->seg [i];
+
+	    if (is_external (seg->addr, seg->len))
+		status = async_add (job, RW_MEMORY, seg->addr,
+			seg->data, seg->len);
+	}
+    }
+    if (status == 0)
+	status = async_add_cpucs (job, cpucs_addr, 0);
+    for (i = 0; i < image->count && status == 0; i++) {
+	const struct ram_segment	*seg = &image->seg [i];
+
+	if (!is_external (seg->addr, seg->len))
+	    status = async_add (job, RW_INTERNAL, seg->addr,
+		    seg->data, seg->len);
+	else if (!stage) {
+	    ezusb_log (job->dev,
+		"can't write %u bytes external memory at 0x%04x\n",
+		seg->len, seg->addr);
+	    return -EINVAL;
+	}
+    }
+    if (status == 0)
+	status = async_add_cpucs (job, cpucs_addr, 1);
+    return status;
+}
+
+/* queues as many writes as may be outstanding at once */
+static int async_submit (struct ezusb_async *job)
+{
+    while (job->next < job->count && job->pending < ASYNC_DEPTH) {
+	struct async_op		*op = &job->op [job->next];
+	struct ctrl_urb		*u;
+	int			status;
+
+	/* CPUCS writes go alone */
+	if (job->pending && (!op->data || !job->op [job->next - 1].data))
+	    break;
+
+	for (u = job->urbs; u->busy; u++)
+	    continue;
+	memcpy (u->buf + 8, op->data ? op->data : &op->cpucs, op->len);
+	if (job->dev->verbose >= 2)
+	    ezusb_log (job->dev, "queue %s, addr 0x%04x len %4u\n",
+		op->data ? (op->request == RW_MEMORY
+			? "write external" : "write on-chip")
+		    : (op->cpucs ? "stop CPU" : "reset CPU"),
+		op->addr, op->len);
+	status = ctrl_urb_submit (job->dev, u,
+		USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+		op->request, op->addr, 0, op->len);
+	if (status < 0) {
+	    ezusb_log (job->dev, "can't queue request: %s\n",
+		strerror (-status));
+	    return status;
+	}
+	if (!job->pending)
+	    job->progress = ezusb_msec ();
+	u->offset = job->next++;
+	job->pending++;
+    }
+    return 0;
+}
+
+/* gives up on what's queued; returns the first op not completed */
+static unsigned async_discard (struct ezusb_async *job)
+{
+    struct usbdevfs_urb		*urb;
+    unsigned			i, first = job->next;
+
+    for (i = 0; i < ASYNC_DEPTH; i++) {
+	if (job->urbs [i].busy) {
+	    if (job->urbs [i].offset < first)
+		first = job->urbs [i].offset;
+	    ioctl (job->dev->fd, USBDEVFS_DISCARDURB, &job->urbs [i].urb);
+	}
+    }
+    while (job->pending
+	    && usbfs_reap (job->dev, USBDEVFS_REAPURB, &urb) == 0) {
+	((struct ctrl_urb *) urb->usercontext)->busy = 0;
+	job->pending--;
+    }
+    return first;
+}
+
+/*
+ * Timeouts are retried as ram_poke() retries them, up to RETRY_LIMIT
+ * times without progress, resending everything from the first write
+ * that didn't complete; writing the same RAM or CPUCS again is harmless.
+ */
+static int async_retry (struct ezusb_async *job, unsigned first)
+{
+    unsigned			queued;
+
+    if (job->retries == RETRY_LIMIT)
+	return -ETIMEDOUT;
+    job->retries++;
+    job->dev->stats.retries++;
+    queued = async_discard (job);
+    job->next = (queued < first) ? queued : first;
+    if (job->dev->verbose)
+	ezusb_log (job->dev, "timed out, retrying from request %u\n",
+	    job->next);
+    return async_submit (job);
+}
+
+/* collects whatever writes have completed, without waiting */
+static int async_reap (struct ezusb_async *job)
+{
+    struct usbdevfs_urb		*urb;
+
+    while (job->pending) {
+	struct ctrl_urb		*u;
+	struct async_op		*op;
+
+	if (usbfs_reap (job->dev, USBDEVFS_REAPURBNDELAY, &urb) < 0)
+	    return (errno == EAGAIN) ? 0 : -errno;
+	u = urb->usercontext;
+	u->busy = 0;
+	job->pending--;
+	job->progress = ezusb_msec ();
+
+	op = &job->op [u->offset];
+	if (urb->status == -ETIMEDOUT) {
+	    job->dev->stats.errors++;
+	    return async_retry (job, u->offset);
+	}
+	if (urb->status < 0) {
+	    job->dev->stats.errors++;
+	    ezusb_log (job->dev, "write 0x%04x: %s\n",
+		op->addr, strerror (-urb->status));
+	    return urb->status;
+	}
+	job->dev->stats.bytes_out += urb->actual_length;
+	if (urb->actual_length != op->len) {
+	    ezusb_log (job->dev, "write 0x%04x ==> %d\n",
+		op->addr, urb->actual_length);
+	    return -EIO;
+	}
+	job->retries = 0;
+
+	/* resent ops count once */
+	if (u->offset < job->acked)
+	    continue;
+	job->acked = u->offset + 1;
+	if (op->data) {
+	    job->total += op->len;
+	    progress_add (job->dev, EZUSB_PROGRESS_RAM, op->len);
+	}
+    }
+    return 0;
+}
+
+/* discards anything still queued, then reports the job's status */
+static void async_finish (struct ezusb_async *job, int status)
+{
+    if (job->pending)
+	async_discard (job);
+
+    job->status = status;
+    if (status == -ETIMEDOUT)
+	ezusb_log (job->dev, "firmware download timed out\n");
+    else if (status < 0 && status != -ECANCELED)
+	ezusb_log (job->dev, "unable to download firmware\n");
+    else if (status == 0 && job->dev->verbose)
+	ezusb_log (job->dev, "... WROTE: %u bytes, %u requests\n",
+	    job->total, job->count);
+    if (status == 0)
+	progress_end (job->dev, EZUSB_PROGRESS_RAM);
+    if (job->done)
+	job->done (job, status, job->arg);
+}
+
+struct ezusb_async *ezusb_load_image_start (
+    struct ezusb		*dev,
+    const struct ezusb_image	*image,
+    int				fx2,
+    int				stage,
+    void			(*done) (struct ezusb_async *job, int status,
+					void *arg),
+    void			*arg
+) {
+    struct ezusb_async		*job;
+    int				status;
+
+    job = calloc (1, sizeof *job);
+    if (!job)
+	return NULL;
+    job->dev = dev;
+    job->status = -EINPROGRESS;
+
+    status = async_plan (job, image, fx2, stage);
+    if (status == 0) {
+	unsigned long	total = 0;
+	unsigned	i;
+
+	for (i = 0; i < image->count; i++)
+	    total += image->seg [i].len;
+	progress_begin (dev, EZUSB_PROGRESS_RAM, total);
+	status = async_submit (job);
+    }
+    if (status < 0) {
+	async_finish (job, status);
+	ezusb_async_free (job);
+	errno = -status;
+	return NULL;
+    }
+    job->done = done;
+    job->arg = arg;
+    return job;
+}
+
+int ezusb_async_poll (struct ezusb_async *job)
+{
+    int				status;
+
+    if (job->status != -EINPROGRESS)
+	return job->status;
+
+    status = async_reap (job);
+    if (status == 0)
+	status = async_submit (job);
+    if (status < 0)
+	async_finish (job, status);
+    else if (job->next == job->count && !job->pending)
+	async_finish (job, 0);
+    else if (ezusb_msec () - job->progress >= job->dev->timeout) {
+	status = async_retry (job, job->next);
+	if (status < 0)
+	    async_finish (job, status);
+    }
+    return job->status;
+}
+
+int ezusb_async_timeout (const struct ezusb_async *job)
+{
+    long long			left;
+
+    if (job->status != -EINPROGRESS)
+	return -1;
+
+    /* completions reaped on its behalf won't make the fd poll */
+    if (job->dev->nstray)
+	return 0;
+    left = job->progress + job->dev->timeout - ezusb_msec ();
+    return (left > 0) ? left : 0;
+}
+
+void ezusb_async_cancel (struct ezusb_async *job)
+{
+    if (job->status == -EINPROGRESS)
+	async_finish (job, -ECANCELED);
+}
+
+void ezusb_async_free (struct ezusb_async *job)
+{
+    if (!job)
+	return;
+    job->done = NULL;
+    ezusb_async_cancel (job);
+    free (job->op);
+    free (job);
+}
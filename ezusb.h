@@ -20,6 +20,157 @@
  *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
  */
 
+#include <stdio.h>
+
+/*
+ * libfxload:  everything here works through a context, which holds the
+ * device (an open usbfs node), where messages go, and the settings and
+ * statistics for its operations.  Nothing is global, so separate
+ * contexts may be used from separate threads at once; one context must
+ * only be used by one thread at a time.
+ */
+struct ezusb;
+
+/* returns a context with no device, or NULL */
+extern struct ezusb *ezusb_new (void);
+extern void ezusb_free (struct ezusb *dev);
+
+/*
+ * Opens the usbfs device node, closing any device the context had
+ * opened before; returns zero, else negative errno.  ezusb_set_fd()
+ * instead uses a file descriptor the caller opened (and will close).
+ */
+extern int ezusb_open (struct ezusb *dev, const char *path);
+extern void ezusb_set_fd (struct ezusb *dev, int fd);
+extern void ezusb_close (struct ezusb *dev);
+extern int ezusb_fd (const struct ezusb *dev);
+
+/*
+ * Every control request goes through the context's transport, which is
+ * usbfs unless set otherwise.  Its control() function returns the
+ * number of bytes transferred, else negative errno.  Only transports
+ * with "urbs" set let URBs be queued on ezusb_fd(); without that, EEPROM
+ * reads aren't pipelined, and asynchronous loads fail with ENOTTY.
+ * The caller owns the transport's argument, and frees it after the
+ * context stops using it.
+ */
+struct ezusb_ctrl {
+    unsigned char	request_type, request;
+    unsigned short	value, index, length;
+    unsigned char	*data;
+    unsigned		timeout;	/* msec */
+};
+
+struct ezusb_transport {
+    const char		*name;
+    int			(*control) (struct ezusb *dev, void *arg,
+				const struct ezusb_ctrl *ctrl);
+    int			urbs;
+};
+
+extern void ezusb_set_transport (struct ezusb *dev,
+	const struct ezusb_transport *transport, void *arg);
+extern void ezusb_get_transport (const struct ezusb *dev,
+	const struct ezusb_transport **transport, void **arg);
+
+/* USBDEVFS_CONTROL, or a URB submitted and reaped; no argument */
+extern const struct ezusb_transport ezusb_usbfs_transport;
+extern const struct ezusb_transport ezusb_usbfs_async_transport;
+
+/*
+ * An EZ-USB device in memory, so the loader can be exercised and
+ * measured without hardware.  It has 64 KB of RAM, the CPUCS register
+ * (at 0xe600 for FX2, else 0x7f92), and an EEPROM of the given size
+ * (a power of two, at least 256 bytes), initially erased.  While its
+ * CPU runs, it also acts as a second stage loader answering the
+ * external memory and EEPROM requests; other requests stall.  Peek and
+ * poke access its memory directly, for checking and preloading.  It
+ * counts the page write cycles EEPROM writes cost, given the part's
+ * page size (32 bytes unless set), so layouts can be compared.
+ */
+struct ezusb_fake;
+extern struct ezusb_fake *ezusb_fake_new (int fx2, unsigned eeprom_size);
+extern void ezusb_fake_free (struct ezusb_fake *fake);
+extern int ezusb_fake_peek (struct ezusb_fake *fake, int space,
+	unsigned addr, unsigned char *buf, unsigned len);
+extern int ezusb_fake_poke (struct ezusb_fake *fake, int space,
+	unsigned addr, const unsigned char *buf, unsigned len);
+extern void ezusb_fake_set_page_size (struct ezusb_fake *fake,
+	unsigned page_size);
+extern unsigned long ezusb_fake_page_writes (const struct ezusb_fake *fake);
+extern const struct ezusb_transport ezusb_fake_transport;
+
+#define EZUSB_FAKE_RAM		1
+#define EZUSB_FAKE_EEPROM	2
+
+/*
+ * Passes requests to another transport, writing a line for each to the
+ * file:  the setup packet fields and length in hex, the result, then
+ * the data sent or received, as in
+ *	40 a0 e600 0000 0001 = 1 01
+ * Wrapped transports don't get URBs, so the log has every transfer.
+ */
+struct ezusb_recorder;
+extern struct ezusb_recorder *ezusb_recorder_new (FILE *f,
+	const struct ezusb_transport *transport, void *arg);
+extern void ezusb_recorder_free (struct ezusb_recorder *rec);
+extern const struct ezusb_transport ezusb_recorder_transport;
+
+/*
+ * Messages (errors, and more with higher verbosity) are passed to the
+ * log function, with their newlines; without one they go to stderr.
+ */
+extern void ezusb_set_log (struct ezusb *dev,
+	void (*log) (void *arg, const char *message), void *arg);
+extern void ezusb_set_verbose (struct ezusb *dev, int level);
+
+/* how long each control request may take; the default is 10 seconds */
+extern void ezusb_set_timeout (struct ezusb *dev, unsigned msec);
+
+/* EEPROM page size in bytes, a power of two; zero means guess */
+extern void ezusb_set_page_size (struct ezusb *dev, int page_size);
+
+/* when nonzero, EEPROM segments are sorted, and those at most this many
+ * bytes apart in on-chip RAM merged, so the device boots faster; gaps
+ * past EZUSB_MERGE_GAP_MAX take longer to read than a segment header,
+ * so larger values are treated as that
+ */
+extern void ezusb_set_merge_gap (struct ezusb *dev, unsigned gap);
+
+#define EZUSB_MERGE_GAP_MAX	9
+
+/* when set, EEPROM writes are journaled in this file, so an interrupted
+ * write resumes where it left off; the file is removed when done
+ */
+extern int ezusb_set_journal (struct ezusb *dev, const char *path);
+
+/* what the context has done so far */
+struct ezusb_stats {
+    unsigned long	requests;	/* control requests issued */
+    unsigned long	errors;		/* ... which failed */
+    unsigned long	retries;	/* ... which were retried */
+    unsigned long long	bytes_in, bytes_out;
+};
+
+extern void ezusb_get_stats (const struct ezusb *dev,
+	struct ezusb_stats *stats);
+
+/*
+ * Progress of longer operations:  the function is called as each phase
+ * begins (done is zero), at most ten times a second while it runs, and
+ * once it's finished (done equals total).  Totals are in bytes, and may
+ * be overestimates when an update finds some pages already match.
+ */
+extern void ezusb_set_progress (struct ezusb *dev,
+	void (*progress) (void *arg, int phase,
+		unsigned long done, unsigned long total),
+	void *arg);
+
+#define EZUSB_PROGRESS_RAM	1	/* downloading to RAM */
+#define EZUSB_PROGRESS_EEPROM	2	/* writing (or erasing) EEPROM */
+#define EZUSB_PROGRESS_READ	3	/* reading EEPROM back to a file */
+
+
 /*
  * This function loads the firmware from the given file into RAM.
  * The file is assumed to be in Intel HEX format.  If fx2 is set, uses
@@ -29,7 +180,47 @@
  *
  * The target processor is reset at the end of this download.
  */
-extern int ezusb_load_ram (int dev, const char *path, int fx2, int stage);
+extern int ezusb_load_ram (struct ezusb *dev, const char *path,
+	int fx2, int stage);
+
+/*
+ * A firmware hexfile parsed into memory, so it can be downloaded many
+ * times (such as by a resident loader) without rereading the file.
+ * ezusb_image_read() returns NULL after reporting any error.
+ */
+struct ezusb_image;
+extern struct ezusb_image *ezusb_image_read (struct ezusb *dev,
+	const char *path);
+extern void ezusb_image_free (struct ezusb_image *image);
+
+/* as ezusb_load_ram(), but with an image that's already parsed */
+extern int ezusb_load_image (struct ezusb *dev,
+	const struct ezusb_image *image, int fx2, int stage);
+
+/*
+ * Asynchronous RAM loads:  ezusb_load_image_start() queues the first
+ * writes of the same download ezusb_load_image() does and returns at
+ * once (NULL, with errno set, if it can't).  The caller then waits for
+ * ezusb_fd() to poll writable, or for ezusb_async_timeout() msec (-1
+ * once it's done), and calls ezusb_async_poll() to queue more.  That
+ * returns -EINPROGRESS until the load finishes, then its status; the
+ * "done" callback, if any, is called from it with the same status.
+ *
+ * ezusb_async_cancel() discards whatever is still queued, so a hung load
+ * needn't wait for the timeout; the callback sees -ECANCELED.  Freeing
+ * a job cancels it, without a callback.  A context runs one job at a
+ * time, and nothing else while it does; the image must stay around
+ * until the job is freed.
+ */
+struct ezusb_async;
+extern struct ezusb_async *ezusb_load_image_start (struct ezusb *dev,
+	const struct ezusb_image *image, int fx2, int stage,
+	void (*done) (struct ezusb_async *job, int status, void *arg),
+	void *arg);
+extern int ezusb_async_poll (struct ezusb_async *job);
+extern int ezusb_async_timeout (const struct ezusb_async *job);
+extern void ezusb_async_cancel (struct ezusb_async *job);
+extern void ezusb_async_free (struct ezusb_async *job);
 
 
 /*
@@ -40,22 +231,82 @@ extern int ezusb_load_ram (int dev, const char *path, int fx2, int stage);
  * byte is as provided here (zero for an21xx parts) and the EEPROM
  * type is set so that the microcontroller will boot from it.
  *
+ * The boot image is built in memory first.  With EZUSB_EEPROM_UPDATE,
+ * the current EEPROM contents are read and only pages which differ are
+ * rewritten; the type byte is still cleared first and written last.
+ * With EZUSB_EEPROM_VERIFY, everything written is read back and checked
+ * before the type byte is written, and failing pages are rewritten.
+ *
  * The caller must have preloaded a second stage loader that knows
  * how to respond to the EEPROM write request.
  */
 extern int ezusb_load_eeprom (
-	int dev,		/* usbfs device handle */
+	struct ezusb *dev,
 	const char *path,	/* path to hexfile */
 	const char *type,	/* fx, fx2, an21 */
 	int config,		/* config byte for fx/fx2; else zero */
 	int large_eeprom,
-	int ww_config_vid,int ww_config_pid  /* VID:PID to write into EEPROM or -1*/
+	int ww_config_vid,int ww_config_pid,  /* VID:PID to write into EEPROM or -1*/
+	int flags		/* EZUSB_EEPROM_* */
+	);
+
+/* read the EEPROM first, and rewrite only the pages that changed */
+#define EZUSB_EEPROM_UPDATE	0x0001
+/* read back what was written, rewriting pages that don't match */
+#define EZUSB_EEPROM_VERIFY	0x0002
+
+
+/*
+ * Builds the same EEPROM boot image ezusb_load_eeprom() would write,
+ * without a device, and saves it as a raw (Cypress ".iic") file.
+ */
+extern int ezusb_build_eeprom (
+	struct ezusb *dev,	/* only for messages and settings */
+	const char *path,	/* path to hexfile, or NULL */
+	const char *type,	/* fx, fx2, an21 */
+	int config,		/* config byte for fx/fx2; else zero */
+	int ww_config_vid,int ww_config_pid,  /* VID:PID to write into EEPROM or -1*/
+	const char *out		/* where to save the image */
 	);
 
+/*
+ * Writes a prebuilt raw (".iic") boot image into the EEPROM, a page
+ * at a time.  Flags and requirements are as for ezusb_load_eeprom().
+ */
+extern int ezusb_flash_eeprom (struct ezusb *dev, const char *path, int large_eeprom,
+	int flags);
+
+/*
+ * Erases the EEPROM, whose size is detected.  With
+ * EZUSB_EEPROM_ERASE_USED, only the area used by its boot image is
+ * erased, which is much quicker for small images.
+ */
+extern int ezusb_erase_eeprom (struct ezusb *dev, int large_eeprom, int flags);
 
-/* boolean flag, says whether to write extra messages to stderr */
-extern int verbose;
+/* erase only what the current boot image uses */
+#define EZUSB_EEPROM_ERASE_USED	0x0004
 
-extern int ezusb_erase_eeprom (int dev, int large_eeprom);
+/*
+ * Overwrites just the EEPROM type byte so the part no longer boots,
+ * and with EZUSB_EEPROM_INVALIDATE_HEADER the first segment header,
+ * then checks that took effect.
+ */
+extern int ezusb_invalidate_eeprom (struct ezusb *dev, int large_eeprom, int flags);
+
+/* also clear the first segment header when invalidating */
+#define EZUSB_EEPROM_INVALIDATE_HEADER	0x0008
+
+/* returns the EEPROM size in bytes, else negative errno; this only
+ * reads, so a blank part reports the largest size its addressing allows
+ */
+extern int ezusb_eeprom_size (struct ezusb *dev, int large_eeprom);
+
+/*
+ * Reads the boot EEPROM back into the given file, as Intel HEX if its
+ * name ends in ".hex" or ".ihx", else as a raw image.  Reading stops at
+ * the end of the boot image when the EEPROM holds a C0/C2/B0/B2/B4/B6
+ * boot record.  Requires a second stage loader, as for writing.
+ */
+extern int ezusb_dump_eeprom (struct ezusb *dev, const char *path, int large_eeprom);
 
 #endif
@@ -30,10 +30,37 @@
  *     -t <type>       -- uController type: an21, fx, fx2, fx2lp
  *     -s <path>       -- use this second stage loader
  *     -c <byte>       -- Download to EEPROM, with this config byte
+ *     -p <bytes>      -- EEPROM page size (default: guessed)
+ *     -u              -- Update EEPROM, rewriting only changed pages
+ *     -E              -- Erase EEPROM
+ *     --erase-used    -- Erase only what the EEPROM boot image uses
+ *     --invalidate[=header] -- Only make the EEPROM unbootable
+ *     --verify        -- Read back and check what's written to EEPROM
+ *     --merge-gap <bytes> -- Merge EEPROM segments, to boot faster
+ *     --journal <path> -- Resume interrupted EEPROM writes using this file
+ *     --build-iic <path> -- Save EEPROM boot image (-I, -t, -c), no device
+ *     --flash-iic <path> -- Write a prebuilt EEPROM boot image
+ *     --dump-eeprom <path> -- Read EEPROM into this file (hex or raw)
+ *     --progress      -- Show progress of downloads and EEPROM writes
  *
  *     -L <path>       -- Create a symbolic link to the device.
  *     -m <mode>       -- Set the permissions on the device after download.
  *     -D <path>       -- Use this device, instead of $DEVICE
+ *     --match <VID:PID> -- Use all devices with this ID, found in sysfs
+ *     --port <path>   -- ... only the one at this port, like "1-1.4"
+ *     --serial <string> -- ... only those with this serial number
+ *     --daemon        -- Stay resident, handling matching devices as they
+ *                        appear (uses kernel uevents)
+ *     --jobs <count>  -- ... handling at most this many at once
+ *     --per-bus <count> -- ... and at most this many on any one bus
+ *     --station       -- Like --daemon, for a production line:  verify
+ *                        EEPROM writes, report throughput and latencies
+ *     --manifest <path> -- Look up what to load by VID:PID in this file
+ *     --wait[=<secs>] -- Wait for the device to renumerate, print its path
+ *     --lock[=skip]   -- One load per port at a time; maybe skip repeats
+ *     --state[=<path>] -- Record what was loaded into each port
+ *     --control <path> -- Serve load/eeprom/erase/dump requests on this
+ *                        Unix socket
  *
  *     -V              -- Print version ID for program
  *
@@ -57,8 +84,16 @@
 # include  <sys/stat.h>
 # include  <fcntl.h>
 # include  <unistd.h>
+# include  <poll.h>
+# include  <time.h>
 
 # include  "ezusb.h"
+# include  "usbdev.h"
+# include  "daemon.h"
+# include  "manifest.h"
+# include  "control.h"
+# include  "station.h"
+# include  "statedb.h"
 
 #ifndef	FXLOAD_VERSION
 #	define FXLOAD_VERSION (__DATE__ " (development)")
@@ -71,6 +106,60 @@
 
 static int dosyslog=0;
 
+/* long options, without short equivalents */
+enum {
+    OPT_DUMP_EEPROM = 0x100,
+    OPT_VERIFY,
+    OPT_ERASE_USED,
+    OPT_INVALIDATE,
+    OPT_BUILD_IIC,
+    OPT_FLASH_IIC,
+    OPT_MERGE_GAP,
+    OPT_JOURNAL,
+    OPT_MATCH,
+    OPT_PORT,
+    OPT_SERIAL,
+    OPT_DAEMON,
+    OPT_JOBS,
+    OPT_PER_BUS,
+    OPT_STATION,
+    OPT_MANIFEST,
+    OPT_WAIT,
+    OPT_LOCK,
+    OPT_CONTROL,
+    OPT_STATE,
+    OPT_PROGRESS,
+    OPT_TRANSPORT,
+    OPT_RECORD,
+};
+
+static const struct option long_options [] = {
+    { "dump-eeprom",	required_argument,	0, OPT_DUMP_EEPROM },
+    { "verify",		no_argument,		0, OPT_VERIFY },
+    { "erase-used",	no_argument,		0, OPT_ERASE_USED },
+    { "invalidate",	optional_argument,	0, OPT_INVALIDATE },
+    { "build-iic",	required_argument,	0, OPT_BUILD_IIC },
+    { "flash-iic",	required_argument,	0, OPT_FLASH_IIC },
+    { "merge-gap",	required_argument,	0, OPT_MERGE_GAP },
+    { "journal",	required_argument,	0, OPT_JOURNAL },
+    { "match",		required_argument,	0, OPT_MATCH },
+    { "port",		required_argument,	0, OPT_PORT },
+    { "serial",		required_argument,	0, OPT_SERIAL },
+    { "daemon",		no_argument,		0, OPT_DAEMON },
+    { "jobs",		required_argument,	0, OPT_JOBS },
+    { "per-bus",	required_argument,	0, OPT_PER_BUS },
+    { "station",	no_argument,		0, OPT_STATION },
+    { "manifest",	required_argument,	0, OPT_MANIFEST },
+    { "wait",		optional_argument,	0, OPT_WAIT },
+    { "lock",		optional_argument,	0, OPT_LOCK },
+    { "control",	required_argument,	0, OPT_CONTROL },
+    { "state",		optional_argument,	0, OPT_STATE },
+    { "progress",	no_argument,		0, OPT_PROGRESS },
+    { "transport",	required_argument,	0, OPT_TRANSPORT },
+    { "record",		required_argument,	0, OPT_RECORD },
+    { 0, 0, 0, 0 }
+};
+
 void logerror(const char *format, ...)
     __attribute__ ((format (__printf__, 1, 2)));
 
@@ -86,21 +175,612 @@ void logerror(const char *format, ...)
     va_end(ap);
 }
 
+/* more messages as this goes up, with "-v" */
+int			verbose;
+
+/* libfxload's messages go where ours do */
+static void log_message (void *arg, const char *message)
+{
+    logerror("%s", message);
+}
+
+/*
+ * With "--progress":  a bar on a terminal, else one parsable line per
+ * report ("progress eeprom 4096/16384"), which libfxload rate limits.
+ */
+static void show_progress (void *arg, int phase,
+	unsigned long done, unsigned long total)
+{
+      static const char	*const names [] = { "?", "ram", "eeprom", "read" };
+      static const char	bar [] = "########################################";
+      const int		width = sizeof bar - 1;
+      const char	*name = names [phase < 4 ? phase : 0];
+      int		fill = total ? (unsigned long long) done * width / total : width;
+
+      if (!isatty (STDERR_FILENO)) {
+	    fprintf (stderr, "progress %s %lu/%lu\n", name, done, total);
+	    return;
+      }
+      fprintf (stderr, "\r%-6s [%-*.*s] %3d%%", name, width, fill, bar,
+		fill * 100 / width);
+      if (done == total)
+	    fputc ('\n', stderr);
+}
+
+/* the library context, set up from the options; one device at a time */
+static struct ezusb	*ez = 0;
+
+static const char	*link_path = 0;
+static const char	*ihex_path = 0;
+static const char	*type = 0;
+static const char	*stage1 = 0;
+static const char	*dump_path = 0;
+static const char	*build_path = 0;
+static const char	*flash_path = 0;
+static mode_t		mode = 0;
+static int		config = -1;
+static int		do_erase = 0;
+static int		do_invalidate = 0;
+static int		large_eeprom = 0;
+static int		eeprom_flags = 0;
+static int		ww_config_vid=-1,ww_config_pid=-1;
+static int		eeprom_page_size = 0;
+static int		eeprom_merge_gap = 0;
+static const char	*eeprom_journal = 0;
+
+/* with --lock, loads are serialized per port; maybe skipping repeats */
+static int		lock_mode = 0;
+#define	LOCK_WAIT	1
+#define	LOCK_SKIP	2
+
+/* with --daemon, devices on a port loaded this recently are renumerating */
+static int		renum_skip = 0;
+#define	RENUM_WINDOW	5000	/* msec */
+
+/* with --wait, how long to wait for devices to renumerate */
+static int		wait_timeout = -1;	/* seconds */
+
+/* with --match, --port or --serial, devices are found through sysfs */
+static struct usbdev_match	match_spec = { -1, -1, 0, 0 };
+static struct usbdev_match	*match = 0;
+
+/* resident loaders parse firmware once, up front */
+static struct ezusb_image	*ihex_image = 0;
+static struct ezusb_image	*stage1_image = 0;
+
+/* with --station, statistics shared by all boards, and this board's */
+static struct station		*station = 0;
+static struct station_board	*current_board = 0;
+static char			station_iic [256];
+
+/* with --state, what was last loaded where */
+static struct statedb		*state = 0;
+
+/* with --manifest, what to load depends on the device */
+static struct manifest		*manifest = 0;
+
+/* finds what the manifest says to load, and parses it if needed */
+static struct manifest_entry *manifest_entry (const struct usbdev *dev)
+{
+      struct manifest_entry	*e = manifest_lookup (manifest, dev);
+
+      if (!e) {
+	    if (verbose >= 2)
+		logerror("%s: %04x:%04x not in manifest\n",
+			dev->path, dev->vid, dev->pid);
+	    return 0;
+      }
+      if (manifest_prepare (manifest, e, ez) != 0)
+	    return 0;
+      return e;
+}
+
+/* makes load_device() load what a manifest entry says */
+static void use_entry (const struct manifest_entry *e)
+{
+      type = e->type;
+      ihex_path = e->firmware;
+      ihex_image = e->firmware_image;
+      stage1 = e->loader;
+      stage1_image = e->loader_image;
+      config = e->config;
+}
+
+/* without sysfs, the IDs come from the device descriptor */
+static int read_device_ids (const char *path, struct usbdev *dev)
+{
+      unsigned char	desc [18];
+      int		fd = open(path, O_RDONLY);
+
+      if (fd == -1)
+	    return -1;
+      if (read (fd, desc, sizeof desc) != sizeof desc) {
+	    close (fd);
+	    return -1;
+      }
+      close (fd);
+      memset (dev, 0, sizeof *dev);
+      snprintf (dev->path, sizeof dev->path, "%s", path);
+      dev->vid = desc [8] | (desc [9] << 8);
+      dev->pid = desc [10] | (desc [11] << 8);
+      dev->bcd = desc [12] | (desc [13] << 8);
+      return 0;
+}
+
+/* state database records are keyed by port, else by usbfs path */
+static int state_device (const char *device_path, struct usbdev *dev)
+{
+      if (usbdev_find (device_path, dev) == 0)
+	    return 0;
+      if (read_device_ids (device_path, dev) < 0)
+	    return -1;
+      snprintf (dev->name, sizeof dev->name, "%s", device_path);
+      return 0;
+}
+
+/* says what the state database remembers about the device */
+static void state_show (const struct usbdev *dev)
+{
+      struct statedb_record	rec;
+      static const char		*const what [] = {
+	    "nothing", "RAM", "EEPROM", "erased EEPROM",
+      };
+
+      if (statedb_lookup (state, dev->name, &rec) < 0) {
+	    logerror("%s: nothing loaded before\n", dev->name);
+	    return;
+      }
+      logerror("%s: %s %016llx loaded %lld seconds ago (as %04x:%04x)%s\n",
+	    dev->name, what [rec.what & 3], rec.hash,
+	    (long long) time (0) - rec.loaded, rec.vid, rec.pid,
+	    rec.loader ? ", loader still running" : "");
+}
+
+/* records what load_device() just did:  "what" is STATEDB_RAM etc */
+static void state_record (const struct usbdev *dev, int what)
+{
+      struct statedb_record	rec;
+      const char		*path = flash_path ? flash_path : ihex_path;
+      int			status;
+
+      memset (&rec, 0, sizeof rec);
+      rec.vid = dev->vid;
+      rec.pid = dev->pid;
+      rec.loaded = time (0);
+      rec.config = -1;
+      rec.what = what;
+      if (path && rec.what != STATEDB_ERASED)
+	    rec.hash = statedb_hash_file (path);
+      if (rec.what != STATEDB_RAM) {
+	    rec.loader = (stage1 != 0);
+	    rec.config = config;
+	    rec.large = large_eeprom;
+	    rec.page_size = eeprom_page_size;
+      }
+
+      status = statedb_update (state, dev->name, &rec);
+      if (status < 0)
+	    logerror("%s: can't record state, %s\n", dev->name,
+		    strerror(-status));
+}
+
+static int load_ram (const char *path, const struct ezusb_image *image,
+	int fx2, int stage)
+{
+      if (image)
+	    return ezusb_load_image (ez, image, fx2, stage);
+      return ezusb_load_ram (ez, path, fx2, stage);
+}
+
+/*
+ * Does whatever was requested to one device:  downloads firmware,
+ * or reads or writes its EEPROM, then maybe links and chmods it.
+ */
+static int load_device (const char *device_path)
+{
+      if (ihex_path || do_erase || do_invalidate || dump_path || flash_path
+		  || (ww_config_vid && ww_config_pid)) {
+	    struct usbdev	dev;
+	    int	have_dev = 0;
+	    int status;
+	    int	fx2;
+	    int	what = STATEDB_RAM;
+
+	    /* look this up before any renumeration */
+	    if (state && !dump_path
+			&& state_device (device_path, &dev) == 0) {
+		have_dev = 1;
+		if (verbose)
+		    state_show (&dev);
+	    }
+
+	    status = ezusb_open (ez, device_path);
+	    if (status < 0) {
+		logerror("%s : %s\n", strerror(-status), device_path);
+		return -1;
+	    }
+	    if (verbose && match)
+		logerror("device %s\n", device_path);
+
+	    if (type == 0) {
+		type = "fx";	/* an21-compatible for most purposes */
+		fx2 = 0;
+	    } else if (strcmp (type, "fx2lp") == 0)
+                fx2 = 2;
+            else
+                fx2 = (strcmp (type, "fx2") == 0);
+
+	    if (verbose)
+		logerror("microcontroller type: %s\n", type);
+
+	    if (stage1) {
+		/* first stage:  put loader into internal memory */
+		if (verbose)
+		    logerror("1st stage:  load 2nd stage loader\n");
+		status = load_ram (stage1, stage1_image, fx2, 0);
+		if (status != 0) {
+		    ezusb_close (ez);
+		    return status;
+		}
+		station_mark (current_board, STATION_LOADER);
+
+		/* second stage ... write either EEPROM, or RAM.  */
+		if (dump_path)
+		    status = ezusb_dump_eeprom (ez, dump_path, large_eeprom);
+		else if (flash_path) {
+		    what = STATEDB_EEPROM;
+		    status = ezusb_flash_eeprom (ez, flash_path, large_eeprom,
+			    eeprom_flags);
+
+		    /* a station then boots the firmware it just wrote
+		     * and checked, as the boot ROM would at power on;
+		     * the CPU reset ending that makes the board renumerate
+		     */
+		    if (status == 0 && station && ihex_path) {
+			if (verbose)
+			    logerror("reset:  run the new firmware\n");
+			status = load_ram (ihex_path, ihex_image, fx2, 1);
+		    }
+		} else if (do_invalidate) {
+		    what = STATEDB_ERASED;
+		    status = ezusb_invalidate_eeprom (ez, large_eeprom,
+			    eeprom_flags);
+		} else if(do_erase) {
+		    what = STATEDB_ERASED;
+		    status = ezusb_erase_eeprom(ez, large_eeprom, eeprom_flags);
+		} else if (config >= 0) {
+		    what = STATEDB_EEPROM;
+		    status = ezusb_load_eeprom (ez, ihex_path, type, config,large_eeprom,
+			ww_config_vid,ww_config_pid, eeprom_flags);
+		} else
+		    status = load_ram (ihex_path, ihex_image, fx2, 1);
+	    } else {
+		/* single stage, put into internal memory */
+		if (verbose)
+		    logerror("single stage:  load on-chip memory\n");
+		status = load_ram (ihex_path, ihex_image, fx2, 0);
+	    }
+	    ezusb_close (ez);
+	    if (status != 0)
+		return status;
+	    station_mark (current_board, STATION_FIRMWARE);
+	    if (have_dev && !dump_path)
+		state_record (&dev, what);
+
+	    /* some firmware won't renumerate, but typically it will.
+	     * link and chmod only make sense without renumeration...
+	     */
+      }
+
+      if (link_path) {
+	    int rc = unlink(link_path);
+	    rc = symlink(device_path, link_path);
+	    if (rc == -1) {
+		  logerror("%s : %s\n", strerror(errno), link_path);
+		  return -1;
+	    }
+      }
+
+      if (mode != 0) {
+	    int rc = chmod(device_path, mode);
+	    if (rc == -1) {
+		  logerror("%s : %s\n", strerror(errno), link_path);
+		  return -1;
+	    }
+      }
+
+      return 0;
+}
+
+static long elapsed_msec (const struct timespec *from)
+{
+      struct timespec	now;
+
+      clock_gettime (CLOCK_MONOTONIC, &now);
+      return (now.tv_sec - from->tv_sec) * 1000
+	    + (now.tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/*
+ * After a download resets the CPU, firmware usually disconnects and
+ * renumerates with new descriptors.  Watch uevents for the device on
+ * the same port to come back, print its new path, and say how long
+ * that took.
+ */
+static int wait_renumerate (int monitor, const struct usbdev *old,
+	const struct timespec *reset)
+{
+      struct usbdev	dev;
+      struct pollfd	pfd = { monitor, POLLIN, 0 };
+      long		gone = -1, left;
+      int		status;
+
+      for (;;) {
+	    while ((status = usbdev_monitor_read (monitor, &dev)) != -EAGAIN) {
+		if (status == -ENOBUFS)
+		    continue;
+		if (status < 0) {
+		    logerror("uevents: %s\n", strerror(-status));
+		    return -1;
+		}
+		if (status == 0 || strcmp (dev.name, old->name) != 0)
+		    continue;
+		if (status == USBDEV_REMOVE) {
+		    gone = elapsed_msec (reset);
+		    continue;
+		}
+
+		/* same port, so it's back; maybe with its old IDs */
+		printf ("%s\n", dev.path);
+		fflush (stdout);
+		logerror("%s: renumerated as %s (%04x:%04x), "
+			"%ld msec after reset",
+			old->path, dev.path, dev.vid, dev.pid,
+			elapsed_msec (reset));
+		if (gone >= 0)
+		    logerror(", disconnected after %ld", gone);
+		logerror("\n");
+		return 0;
+	    }
+
+	    left = wait_timeout * 1000L - elapsed_msec (reset);
+	    if (left <= 0 || poll (&pfd, 1, left) == 0) {
+		logerror("%s: no renumeration within %d seconds\n",
+			old->path, wait_timeout);
+		return -1;
+	    }
+      }
+}
+
+/* load_device(), then maybe wait_renumerate() */
+static int load_and_wait (const char *device_path)
+{
+      struct usbdev	old;
+      struct timespec	reset;
+      int		monitor, status;
+
+      if (wait_timeout < 0)
+	    return load_device (device_path);
+
+      /* listen before the reset, so no events get missed */
+      if (usbdev_find (device_path, &old) < 0) {
+	    logerror("%s: not in sysfs, can't wait for it\n", device_path);
+	    return load_device (device_path);
+      }
+      monitor = usbdev_monitor ();
+      if (monitor < 0) {
+	    logerror("can't listen for uevents: %s\n", strerror(-monitor));
+	    return load_device (device_path);
+      }
+
+      status = load_device (device_path);
+      clock_gettime (CLOCK_MONOTONIC, &reset);
+      if (status == 0)
+	    status = wait_renumerate (monitor, &old, &reset);
+      if (status == 0)
+	    station_mark (current_board, STATION_RENUMERATE);
+      close (monitor);
+      return status;
+}
+
+/* names what's being loaded, to tell whether someone else just did */
+static void load_identity (char *buf, size_t size)
+{
+      const char	*path = flash_path ? flash_path : ihex_path;
+      struct stat	st;
+      long long		len = -1, mtime = -1;
+
+      if (path && stat (path, &st) == 0) {
+	    len = st.st_size;
+	    mtime = st.st_mtime;
+      }
+      snprintf (buf, size, "%s %lld %lld %s %d %d%d %04x:%04x",
+	    path ? path : "-", len, mtime, stage1 ? stage1 : "-",
+	    config, do_erase, do_invalidate, ww_config_vid, ww_config_pid);
+}
+
+/*
+ * load_and_wait(), holding the lock for the device's port so that
+ * concurrent invocations (as when a hub reset triggers several hotplug
+ * events) don't interleave their writes.  With --lock=skip, whoever
+ * had to wait skips loading if the lock holder loaded the same image.
+ * The daemon always locks, and returns 1 without loading a device that
+ * is just the one it loaded renumerating.
+ */
+static int load_locked (const char *device_path)
+{
+      char		id [400];
+      long long		waited;
+      int		lock, status;
+
+      if (!lock_mode && !renum_skip)
+	    return load_and_wait (device_path);
+
+      lock = usbdev_lock (device_path, &waited);
+      if (lock < 0) {
+	    logerror("%s: can't lock, %s\n", device_path, strerror(-lock));
+	    return -1;
+      }
+      load_identity (id, sizeof id);
+      if (lock_mode == LOCK_SKIP && waited >= 0
+		  && usbdev_lock_loaded (lock, id, waited)) {
+	    if (verbose)
+		logerror("%s: just loaded by another process\n", device_path);
+	    close (lock);
+	    return 0;
+      }
+
+      /* firmware that renumerates with the same VID:PID looks like a
+       * new device wanting the same firmware
+       */
+      if (renum_skip && usbdev_lock_loaded (lock, id,
+		  usbdev_boottime () - RENUM_WINDOW)) {
+	    if (verbose)
+		logerror("%s: just loaded on port, renumerated\n",
+			device_path);
+	    close (lock);
+	    return 1;
+      }
+
+      status = load_and_wait (device_path);
+      if (status == 0 && !dump_path)
+	    usbdev_lock_record (lock, id);
+      close (lock);
+      return status;
+}
+
+struct match_result {
+      int	status;
+      int	count;
+};
+
+/* usbdev_scan() callback:  loads each matching device, and keeps going
+ * after failures so one bad board doesn't hold up the rest
+ */
+static int load_match (const struct usbdev *dev, void *context)
+{
+      struct match_result	*result = context;
+
+      if (manifest) {
+	    struct manifest_entry	*e = manifest_lookup (manifest, dev);
+
+	    if (!e)
+		return 0;
+	    result->count++;
+	    if (manifest_prepare (manifest, e, ez) != 0) {
+		result->status = -1;
+		return 0;
+	    }
+	    use_entry (e);
+      } else
+	    result->count++;
+
+      if (load_locked (dev->path) != 0) {
+	    logerror("%s (port %s) failed\n", dev->path, dev->name);
+	    result->status = -1;
+      }
+      return 0;
+}
+
+/* fxload_daemon() callback, before queueing a device */
+static int accept_uevent (const struct usbdev *dev, struct daemon_sched *sched)
+{
+      struct manifest_entry	*e = manifest_entry (dev);
+
+      if (!e)
+	    return -1;
+      sched->priority = e->priority;
+      sched->deadline = e->deadline;
+      return 0;
+}
+
+/* loads a device the daemon found, in a child process; see load_locked() */
+static int load_uevent (const struct usbdev *dev)
+{
+      if (manifest) {
+	    struct manifest_entry	*e = manifest_lookup (manifest, dev);
+
+	    if (!e)
+		return -1;
+	    use_entry (e);
+      }
+      return load_locked (dev->path);
+}
+
+/* fxload_daemon() callback, in a child process */
+static int load_daemon (const struct usbdev *dev)
+{
+      int			status = load_uevent (dev);
+
+      return (status > 0) ? 0 : status;
+}
+
+/* fxload_daemon() callback with --station, in a child process */
+static int load_station (const struct usbdev *dev)
+{
+      struct station_board	board;
+      int			status;
+
+      station_begin (&board, (stage1 ? 1 << STATION_LOADER : 0)
+		  | (ihex_path || flash_path ? 1 << STATION_FIRMWARE : 0)
+		  | (wait_timeout >= 0 ? 1 << STATION_RENUMERATE : 0));
+      current_board = &board;
+      status = load_uevent (dev);
+      current_board = 0;
+      if (status > 0)
+	    return 0;
+
+      station_record (station, &board, dev->name, status);
+      station_report (station);
+      return status;
+}
+
+/*
+ * A station writes the same EEPROM image into every board, so build
+ * it once, into a temporary file, and flash that.
+ */
+static int station_prebuild (void)
+{
+      const char	*tmp = getenv ("TMPDIR");
+      int		fd;
+
+      snprintf (station_iic, sizeof station_iic, "%s/fxload-XXXXXX",
+	    tmp ? tmp : "/tmp");
+      fd = mkstemp (station_iic);
+      if (fd < 0) {
+	    logerror("%s: %s\n", station_iic, strerror(errno));
+	    station_iic [0] = 0;
+	    return -1;
+      }
+      close (fd);
+      if (ezusb_build_eeprom (ez, ihex_path, type, config,
+		  ww_config_vid, ww_config_pid, station_iic) != 0) {
+	    unlink (station_iic);
+	    station_iic [0] = 0;
+	    return -1;
+      }
+      flash_path = station_iic;
+      return 0;
+}
+
 int main(int argc, char*argv[])
 {
-      const char	*link_path = 0;
-      const char	*ihex_path = 0;
       const char	*device_path = getenv("DEVICE");
-      const char	*type = 0;
-      const char	*stage1 = 0;
-      mode_t		mode = 0;
       int		opt;
-      int		config = -1;
-      int		do_erase = 0;
-      int large_eeprom = 0;
-      int		ww_config_vid=-1,ww_config_pid=-1;
+      struct match_result	result = { 0, 0 };
+      const char	*manifest_path = 0;
+      const char	*control_path = 0;
+      const char	*state_path = 0;
+      int		do_daemon = 0;
+      int		jobs = 4;
+      int		per_bus = 0;
+      int		do_station = 0;
+      int		do_progress = 0;
+      const struct ezusb_transport	*transport = &ezusb_usbfs_transport;
+      const char	*record_path = 0;
 
-      while ((opt = getopt (argc, argv, "2vVEe?D:I:L:c:lm:s:t:d:")) != EOF)
+      while ((opt = getopt_long (argc, argv, "2vVEeu?D:I:L:c:lm:p:s:t:d:",
+		      long_options, 0)) != EOF)
       switch (opt) {
 
 	  case '2':		// original version of "-t fx2"
@@ -145,6 +825,15 @@ int main(int argc, char*argv[])
 	    mode &= 0777;
 	    break;
 
+	  case 'p':
+	    eeprom_page_size = strtoul (optarg, 0, 0);
+	    if (eeprom_page_size < 1 || eeprom_page_size > 256
+		    || (eeprom_page_size & (eeprom_page_size - 1)) != 0) {
+		logerror("illegal EEPROM page size: %s\n", optarg);
+		goto usage;
+	    }
+	    break;
+
 	  case 's':
 	    stage1 = optarg;
 	    break;
@@ -161,6 +850,10 @@ int main(int argc, char*argv[])
 	    type = optarg;
 	    break;
 
+	  case 'u':
+	    eeprom_flags |= EZUSB_EEPROM_UPDATE;
+	    break;
+
 	  case 'v':
 	    verbose++;
 	    break;
@@ -173,12 +866,199 @@ int main(int argc, char*argv[])
 	    sscanf(optarg,"%x%*c%x",&ww_config_vid,&ww_config_pid);
 	    break;
 
+	  case OPT_DUMP_EEPROM:
+	    dump_path = optarg;
+	    break;
+
+	  case OPT_VERIFY:
+	    eeprom_flags |= EZUSB_EEPROM_VERIFY;
+	    break;
+
+	  case OPT_ERASE_USED:
+	    eeprom_flags |= EZUSB_EEPROM_ERASE_USED;
+	    do_erase=1;
+	    break;
+
+	  case OPT_INVALIDATE:
+	    if (optarg) {
+		if (strcmp (optarg, "header") != 0) {
+		    logerror("illegal --invalidate option: %s\n", optarg);
+		    goto usage;
+		}
+		eeprom_flags |= EZUSB_EEPROM_INVALIDATE_HEADER;
+	    }
+	    do_invalidate=1;
+	    break;
+
+	  case OPT_BUILD_IIC:
+	    build_path = optarg;
+	    break;
+
+	  case OPT_FLASH_IIC:
+	    flash_path = optarg;
+	    break;
+
+	  case OPT_JOURNAL:
+	    eeprom_journal = optarg;
+	    break;
+
+	  case OPT_MATCH:
+	    if (usbdev_parse_id (optarg, &match_spec.vid, &match_spec.pid)) {
+		logerror("illegal VID:PID: %s\n", optarg);
+		goto usage;
+	    }
+	    match = &match_spec;
+	    break;
+
+	  case OPT_PORT:
+	    match_spec.port = optarg;
+	    match = &match_spec;
+	    break;
+
+	  case OPT_SERIAL:
+	    match_spec.serial = optarg;
+	    match = &match_spec;
+	    break;
+
+	  case OPT_DAEMON:
+	    do_daemon = 1;
+	    break;
+
+	  case OPT_JOBS:
+	    jobs = strtoul (optarg, 0, 0);
+	    if (jobs < 1 || jobs > 256) {
+		logerror("illegal job count: %s\n", optarg);
+		goto usage;
+	    }
+	    break;
+
+	  case OPT_STATION:
+	    do_daemon = 1;
+	    do_station = 1;
+	    eeprom_flags |= EZUSB_EEPROM_VERIFY;
+	    break;
+
+	  case OPT_PER_BUS:
+	    per_bus = strtoul (optarg, 0, 0);
+	    if (per_bus < 1 || per_bus > 256) {
+		logerror("illegal per-bus job count: %s\n", optarg);
+		goto usage;
+	    }
+	    break;
+
+	  case OPT_MANIFEST:
+	    manifest_path = optarg;
+	    break;
+
+	  case OPT_WAIT:
+	    wait_timeout = optarg ? strtoul (optarg, 0, 0) : 10;
+	    if (wait_timeout < 1 || wait_timeout > 3600) {
+		logerror("illegal wait timeout: %s\n", optarg);
+		goto usage;
+	    }
+	    break;
+
+	  case OPT_LOCK:
+	    if (!optarg)
+		lock_mode = LOCK_WAIT;
+	    else if (strcmp (optarg, "skip") == 0)
+		lock_mode = LOCK_SKIP;
+	    else {
+		logerror("illegal --lock option: %s\n", optarg);
+		goto usage;
+	    }
+	    break;
+
+	  case OPT_CONTROL:
+	    control_path = optarg;
+	    break;
+
+	  case OPT_STATE:
+	    state_path = optarg ? optarg : STATEDB_DEFAULT;
+	    break;
+
+	  case OPT_PROGRESS:
+	    do_progress = 1;
+	    break;
+
+	  case OPT_TRANSPORT:
+	    if (strcmp (optarg, "usbfs") == 0)
+		transport = &ezusb_usbfs_transport;
+	    else if (strcmp (optarg, "usbfs-async") == 0)
+		transport = &ezusb_usbfs_async_transport;
+	    else {
+		logerror("illegal transport: %s\n", optarg);
+		goto usage;
+	    }
+	    break;
+
+	  case OPT_RECORD:
+	    record_path = optarg;
+	    break;
+
+	  case OPT_MERGE_GAP:
+	    eeprom_merge_gap = strtoul (optarg, 0, 0);
+	    if (eeprom_merge_gap < 0
+			|| eeprom_merge_gap > EZUSB_MERGE_GAP_MAX) {
+		logerror("illegal merge gap: %s\n", optarg);
+		goto usage;
+	    }
+	    break;
+
 	  case '?':
 	  default:
 	    goto usage;
 
       }
 
+      renum_skip = do_daemon;
+
+      ez = ezusb_new ();
+      if (!ez)
+	    return -1;
+      ezusb_set_log (ez, log_message, 0);
+      ezusb_set_verbose (ez, verbose);
+      ezusb_set_page_size (ez, eeprom_page_size);
+      ezusb_set_merge_gap (ez, eeprom_merge_gap);
+      if (ezusb_set_journal (ez, eeprom_journal) < 0)
+	    return -1;
+      if (do_progress)
+	    ezusb_set_progress (ez, show_progress, 0);
+
+      /* line buffered, so forked children don't repeat each other's */
+      if (record_path) {
+	    FILE			*f = fopen (record_path, "a");
+	    struct ezusb_recorder	*rec;
+
+	    if (!f) {
+		logerror("%s: %s\n", record_path, strerror(errno));
+		return -1;
+	    }
+	    setvbuf (f, 0, _IOLBF, 0);
+	    rec = ezusb_recorder_new (f, transport, 0);
+	    if (!rec)
+		return -1;
+	    ezusb_set_transport (ez, &ezusb_recorder_transport, rec);
+      } else
+	    ezusb_set_transport (ez, transport, 0);
+
+      /* requests say what to do, and to which devices */
+      if (control_path)
+	    return fxload_control (control_path, jobs, ez) ? -1 : 0;
+
+      /* building an EEPROM image doesn't involve any device */
+      if (build_path) {
+	    if (type == 0 || config < 0) {
+		logerror("must specify microcontroller type %s",
+				"and config byte to build EEPROM image!\n");
+		goto usage;
+	    }
+	    if (ezusb_build_eeprom (ez, ihex_path, type, config,
+			ww_config_vid, ww_config_pid, build_path) != 0)
+		return -1;
+	    return 0;
+      }
+
       if (config >= 0) {
 	    if (type == 0) {
 		logerror("must specify microcontroller type %s",
@@ -201,98 +1081,193 @@ int main(int argc, char*argv[])
 	    }
       }
 
-      if (!device_path) {
+      if (flash_path) {
+	    if (!stage1){
+		logerror("need 2nd stage loader %s",
+				"to write EEPROM!\n");
+		goto usage;
+	    }
+	    if (config >= 0 || do_erase || do_invalidate || dump_path) {
+		logerror("--flash-iic writes the whole boot image\n");
+		goto usage;
+	    }
+      }
+
+      if ((do_erase || do_invalidate) && !stage1) {
+	    logerror("need 2nd stage loader %s",
+			    "to erase EEPROM!\n");
+	    goto usage;
+      }
+
+      if (dump_path) {
+	    if (!stage1) {
+		logerror("need 2nd stage loader %s",
+				"to read EEPROM!\n");
+		goto usage;
+	    }
+	    if (config >= 0 || do_erase || do_invalidate) {
+		logerror("can't dump and write EEPROM at once\n");
+		goto usage;
+	    }
+      }
+
+      if (match && link_path) {
+	    logerror("can't link several matching devices\n");
+	    goto usage;
+      }
+
+      if (manifest_path) {
+	    if (ihex_path || stage1 || type || config >= 0 || flash_path
+			|| do_erase || do_invalidate || dump_path) {
+		logerror("the manifest says what to load\n");
+		goto usage;
+	    }
+	    if (link_path) {
+		logerror("can't link devices found with a manifest\n");
+		goto usage;
+	    }
+	    /* with no device given, look at all of them */
+	    if (!match && (do_daemon || !device_path))
+		match = &match_spec;
+      }
+
+      if (do_daemon) {
+	    if (!match) {
+		logerror("--daemon needs --match or --manifest\n");
+		goto usage;
+	    }
+	    if (dump_path) {
+		logerror("can't dump EEPROMs of several devices\n");
+		goto usage;
+	    }
+      }
+
+      if (!device_path && !match) {
 	    logerror("no device specified!\n");
 usage:
 	    fputs ("usage: ", stderr);
 	    fputs (argv [0], stderr);
-	    fputs (" [-vVEe] [-l] [-t type] [-D devpath]\n", stderr);
+	    fputs (" [-vVEeu] [-l] [-t type] [-D devpath]\n", stderr);
 	    fputs ("\t\t[-I firmware_hexfile] ", stderr);
 	    fputs ("[-s loader] [-c config_byte] [-d VID:PID]\n", stderr);
+	    fputs ("\t\t[-p eeprom_page_size] [--verify] [--dump-eeprom path]\n",
+		    stderr);
+	    fputs ("\t\t[--erase-used] [--invalidate[=header]]\n", stderr);
+	    fputs ("\t\t[--build-iic path] [--flash-iic path]\n", stderr);
+	    fputs ("\t\t[--merge-gap bytes] [--journal path] [--progress]\n",
+		    stderr);
+	    fputs ("\t\t[--transport usbfs|usbfs-async] [--record path]\n",
+		    stderr);
+	    fputs ("\t\t[--match VID:PID] [--port path] [--serial string]\n",
+		    stderr);
+	    fputs ("\t\t[--daemon [--jobs count] [--per-bus count]]"
+		    " [--manifest path]\n", stderr);
+	    fputs ("\t\t[--control socket [--jobs count]] [--station]"
+		    " [--state[=path]]\n",
+		    stderr);
+	    fputs ("\t\t[--wait[=seconds]] [--lock[=skip]]\n", stderr);
 	    fputs ("\t\t[-L link] [-m mode]\n", stderr);
 	    fputs ("... [-D devpath] overrides DEVICE= in env\n", stderr);
+	    fputs ("... --match, --port, --serial find devices instead\n",
+		    stderr);
 	    fputs ("... device types:  one of an21, fx, fx2, fx2lp\n", stderr);
 	    fputs ("... at least one of -I, -L, -m, -E is required\n", stderr);
 	    fputs ("options -c and -d affect only EEPROM content\n", stderr);
 	    return -1;
       }
 
-      if (ihex_path || do_erase || (ww_config_vid && ww_config_pid)) {
-	    int fd = open(device_path, O_RDWR);
-	    int status;
-	    int	fx2;
+      if (!ihex_path && !link_path && !mode && !do_erase && !do_invalidate
+		  && !dump_path && !flash_path && !manifest_path
+		  && (!ww_config_vid || !ww_config_pid)) {
+	    logerror("missing request! (firmware, link, mode, erase, dump or device id)\n");
+	    return -1;
+      }
 
-	    if (fd == -1) {
-		logerror("%s : %s\n", strerror(errno), device_path);
+      if (manifest_path) {
+	    manifest = manifest_read (manifest_path);
+	    if (!manifest)
 		return -1;
-	    }
+      }
 
-	    if (type == 0) {
-		type = "fx";	/* an21-compatible for most purposes */
-		fx2 = 0;
-	    } else if (strcmp (type, "fx2lp") == 0)
-                fx2 = 2;
-            else
-                fx2 = (strcmp (type, "fx2") == 0);
+      /* children share the mapping, so lookups stay cheap */
+      if (state_path) {
+	    state = statedb_open (state_path);
+	    if (!state)
+		return -1;
+      }
 
-	    if (verbose)
-		logerror("microcontroller type: %s\n", type);
+      if (do_station) {
+	    int status;
 
-	    if (stage1) {
-		/* first stage:  put loader into internal memory */
-		if (verbose)
-		    logerror("1st stage:  load 2nd stage loader\n");
-		status = ezusb_load_ram (fd, stage1, fx2, 0);
-		if (status != 0)
-		    return status;
+	    if (!manifest && ihex_path && config >= 0 && !flash_path
+			&& station_prebuild () != 0)
+		return -1;
+	    if (stage1 && !manifest
+			&& !(stage1_image = ezusb_image_read (ez, stage1)))
+		status = -1;
+	    else if (!manifest && ihex_path
+			&& !(ihex_image = ezusb_image_read (ez, ihex_path)))
+		status = -1;
+	    else if (!(station = station_open ()))
+		status = -1;
+	    else
+		status = fxload_daemon (match, jobs, per_bus,
+			manifest ? accept_uevent : 0, load_station);
 
-		/* second stage ... write either EEPROM, or RAM.  */
-		if(do_erase)
-		    status = ezusb_erase_eeprom(fd, large_eeprom);
-		else if (config >= 0)
-		    status = ezusb_load_eeprom (fd, ihex_path, type, config,large_eeprom,
-			ww_config_vid,ww_config_pid);
-		else
-		    status = ezusb_load_ram (fd, ihex_path, fx2, 1);
-		if (status != 0)
-		    return status;
-	    } else {
-		/* single stage, put into internal memory */
-		if (verbose)
-		    logerror("single stage:  load on-chip memory\n");
-		status = ezusb_load_ram (fd, ihex_path, fx2, 0);
-		if (status != 0)
-		    return status;
+	    if (station) {
+		station_report (station);
+		station_close (station);
 	    }
-
-	    /* some firmware won't renumerate, but typically it will.
-	     * link and chmod only make sense without renumeration...
-	     */
+	    if (station_iic [0])
+		unlink (station_iic);
+	    return status ? -1 : 0;
       }
 
-      if (link_path) {
-	    int rc = unlink(link_path);
-	    rc = symlink(device_path, link_path);
-	    if (rc == -1) {
-		  logerror("%s : %s\n", strerror(errno), link_path);
-		  return -1;
-	    }
+      if (do_daemon) {
+	    if (manifest)
+		return fxload_daemon (match, jobs, per_bus, accept_uevent,
+			load_daemon) ? -1 : 0;
+
+	    /* parse firmware once; every child shares it */
+	    if (stage1 && !(stage1_image = ezusb_image_read (ez, stage1)))
+		return -1;
+	    if (ihex_path && config < 0
+			&& !(ihex_image = ezusb_image_read (ez, ihex_path)))
+		return -1;
+	    return fxload_daemon (match, jobs, per_bus, 0, load_daemon)
+			? -1 : 0;
       }
 
-      if (mode != 0) {
-	    int rc = chmod(device_path, mode);
-	    if (rc == -1) {
-		  logerror("%s : %s\n", strerror(errno), link_path);
-		  return -1;
+      if (match) {
+	    int status = usbdev_scan (match, load_match, &result);
+
+	    if (status < 0) {
+		logerror("can't scan USB devices: %s\n", strerror(-status));
+		return -1;
 	    }
+	    if (result.count == 0) {
+		logerror("no matching device found\n");
+		return -1;
+	    }
+	    return result.status;
       }
 
-      if (!ihex_path && !link_path && !mode && !do_erase && (!ww_config_vid || !ww_config_pid)) {
-	    logerror("missing request! (firmware, link, mode, erase or device id)\n");
-	    return -1;
-      }
+      if (manifest) {
+	    struct usbdev		dev;
+	    struct manifest_entry	*e;
 
-      return 0;
+	    if (read_device_ids (device_path, &dev) != 0) {
+		logerror("%s : %s\n", strerror(errno), device_path);
+		return -1;
+	    }
+	    e = manifest_entry (&dev);
+	    if (!e) {
+		logerror("%s: nothing to load for %04x:%04x\n",
+			device_path, dev.vid, dev.pid);
+		return -1;
+	    }
+	    use_entry (e);
+      }
 
+      return load_locked (device_path);
 }
-
@@ -0,0 +1,329 @@
+/*
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+/*
+ * Firmware manifests, replacing a pile of udev rules that each run
+ * fxload with different options.  Entries are hashed by VID:PID when
+ * the manifest is read, so finding the one for a device takes constant
+ * time however long the manifest grows.  Hexfiles are parsed only when
+ * some device needs them, and only once however many entries use them.
+ */
+
+# include  <stdio.h>
+# include  <errno.h>
+# include  <ctype.h>
+# include  <stdlib.h>
+# include  <string.h>
+
+# include "manifest.h"
+
+extern void logerror(const char *format, ...)
+    __attribute__ ((format (printf, 1, 2)));
+extern int verbose;
+
+/* a hexfile, parsed or not yet */
+struct manifest_file {
+    char			*path;
+    struct ezusb_image		*image;
+    int				failed;		/* don't keep retrying */
+    struct manifest_file	*next;
+};
+
+struct manifest {
+    struct manifest_entry	*entries;
+    unsigned			count, alloc;
+
+    struct manifest_entry	**hash;
+    unsigned			hash_mask;
+
+    struct manifest_file	*files;
+};
+
+static unsigned manifest_hash (unsigned short vid, unsigned short pid)
+{
+    unsigned		key = (vid << 16) | pid;
+
+    /* multiplicative hashing; buckets are a power of two */
+    return (key * 2654435761u) >> 16;
+}
+
+/* the same path always yields the same string, so files can be shared */
+static const char *manifest_file (struct manifest *m, const char *dir,
+	const char *name)
+{
+    struct manifest_file	*f;
+    char			*path;
+
+    if (name [0] != '/' && dir) {
+	path = malloc (strlen (dir) + strlen (name) + 2);
+	if (path)
+	    sprintf (path, "%s/%s", dir, name);
+    } else
+	path = strdup (name);
+    if (!path)
+	return NULL;
+
+    for (f = m->files; f; f = f->next) {
+	if (strcmp (f->path, path) == 0) {
+	    free (path);
+	    return f->path;
+	}
+    }
+    f = calloc (1, sizeof *f);
+    if (!f) {
+	free (path);
+	return NULL;
+    }
+    f->path = path;
+    f->next = m->files;
+    m->files = f;
+    return f->path;
+}
+
+static int manifest_parse_line (
+    struct manifest		*m,
+    struct manifest_entry	*e,
+    char			*line,
+    const char			*dir
+) {
+    char			*field, *value;
+    int				vid, pid;
+
+    field = strtok (line, " \t");
+    if (usbdev_parse_id (field, &vid, &pid) < 0)
+	return -EINVAL;
+    e->vid = vid;
+    e->pid = pid;
+    e->bcd = -1;
+    e->config = -1;
+
+    while ((field = strtok (NULL, " \t")) != 0) {
+	value = strchr (field, '=');
+	if (!value)
+	    return -EINVAL;
+	*value++ = 0;
+
+	if (strcmp (field, "bcd") == 0)
+	    e->bcd = strtoul (value, 0, 16) & 0xffff;
+	else if (strcmp (field, "port") == 0)
+	    e->port = strdup (value);
+	else if (strcmp (field, "type") == 0) {
+	    if (strcmp (value, "an21") && strcmp (value, "fx")
+		    && strcmp (value, "fx2") && strcmp (value, "fx2lp"))
+		return -EINVAL;
+	    e->type = strdup (value);
+	} else if (strcmp (field, "firmware") == 0)
+	    e->firmware = manifest_file (m, dir, value);
+	else if (strcmp (field, "loader") == 0)
+	    e->loader = manifest_file (m, dir, value);
+	else if (strcmp (field, "config") == 0) {
+	    e->config = strtoul (value, 0, 0);
+	    if (e->config < 0 || e->config > 255)
+		return -EINVAL;
+	} else if (strcmp (field, "priority") == 0)
+	    e->priority = strtol (value, 0, 0);
+	else if (strcmp (field, "deadline") == 0)
+	    e->deadline = strtoul (value, 0, 0);
+	else
+	    return -EINVAL;
+    }
+
+    if (!e->type || !e->firmware)
+	return -EINVAL;
+    if (e->config >= 0 && !e->loader)
+	return -EINVAL;
+    return 0;
+}
+
+static int manifest_index (struct manifest *m)
+{
+    unsigned		size = 16, i, bucket;
+
+    while (size < 2 * m->count)
+	size *= 2;
+    m->hash = calloc (size, sizeof *m->hash);
+    if (!m->hash)
+	return -ENOMEM;
+    m->hash_mask = size - 1;
+
+    /* chains keep file order, so earlier entries win ties */
+    for (i = m->count; i-- > 0; ) {
+	struct manifest_entry	*e = &m->entries [i];
+
+	bucket = manifest_hash (e->vid, e->pid) & m->hash_mask;
+	e->next = m->hash [bucket];
+	m->hash [bucket] = e;
+    }
+    return 0;
+}
+
+struct manifest *manifest_read (const char *path)
+{
+    FILE			*f;
+    struct manifest		*m;
+    char			buf [1024], *cp, *dir = NULL;
+    unsigned			line = 0;
+
+    f = fopen (path, "r");
+    if (!f) {
+	logerror("%s: unable to open for input.\n", path);
+	return NULL;
+    }
+    m = calloc (1, sizeof *m);
+    if (!m)
+	goto fail;
+
+    cp = strrchr (path, '/');
+    if (cp) {
+	dir = strndup (path, cp - path);
+	if (!dir)
+	    goto fail;
+    }
+
+    while (fgets (buf, sizeof buf, f)) {
+	struct manifest_entry	*e;
+
+	line++;
+	cp = strchr (buf, '#');
+	if (cp)
+	    *cp = 0;
+	for (cp = buf; isspace ((unsigned char) *cp); cp++)
+	    continue;
+	if (!*cp)
+	    continue;
+	cp [strcspn (cp, "\r\n")] = 0;
+
+	if (m->count == m->alloc) {
+	    unsigned	alloc = m->alloc ? 2 * m->alloc : 32;
+
+	    e = realloc (m->entries, alloc * sizeof *e);
+	    if (!e)
+		goto fail;
+	    m->entries = e;
+	    m->alloc = alloc;
+	}
+	e = &m->entries [m->count++];
+	memset (e, 0, sizeof *e);
+	e->line = line;
+	if (manifest_parse_line (m, e, cp, dir) < 0) {
+	    logerror("%s:%u: bad manifest entry\n", path, line);
+	    goto fail;
+	}
+    }
+    if (ferror (f) || manifest_index (m) < 0)
+	goto fail;
+
+    fclose (f);
+    free (dir);
+    if (verbose)
+	logerror("manifest %s: %u entries\n", path, m->count);
+    return m;
+
+fail:
+    fclose (f);
+    free (dir);
+    manifest_free (m);
+    return NULL;
+}
+
+void manifest_free (struct manifest *m)
+{
+    struct manifest_file	*f;
+    unsigned			i;
+
+    if (!m)
+	return;
+    for (i = 0; i < m->count; i++) {
+	free ((char *) m->entries [i].port);
+	free ((char *) m->entries [i].type);
+    }
+    while ((f = m->files) != 0) {
+	m->files = f->next;
+	ezusb_image_free (f->image);
+	free (f->path);
+	free (f);
+    }
+    free (m->entries);
+    free (m->hash);
+    free (m);
+}
+
+struct manifest_entry *manifest_lookup (struct manifest *m,
+	const struct usbdev *dev)
+{
+    struct manifest_entry	*e, *best = NULL;
+    int				score, best_score = -1;
+
+    e = m->hash [manifest_hash (dev->vid, dev->pid) & m->hash_mask];
+    for (; e; e = e->next) {
+	if (e->vid != dev->vid || e->pid != dev->pid)
+	    continue;
+	score = 0;
+	if (e->port) {
+	    if (strcmp (e->port, dev->name) != 0)
+		continue;
+	    score += 2;
+	}
+	if (e->bcd >= 0) {
+	    if (e->bcd != dev->bcd)
+		continue;
+	    score += 1;
+	}
+	if (score > best_score) {
+	    best = e;
+	    best_score = score;
+	}
+    }
+    return best;
+}
+
+/* parses a hexfile the first time any entry needs it */
+static struct ezusb_image *manifest_image (struct manifest *m,
+	const char *path, struct ezusb *dev)
+{
+    struct manifest_file	*f;
+
+    for (f = m->files; f; f = f->next) {
+	if (f->path == path)
+	    break;
+    }
+    if (!f || f->failed)
+	return NULL;
+    if (!f->image) {
+	f->image = ezusb_image_read (dev, path);
+	f->failed = !f->image;
+    }
+    return f->image;
+}
+
+int manifest_prepare (struct manifest *m, struct manifest_entry *entry,
+	struct ezusb *dev)
+{
+    if (entry->loader && !entry->loader_image) {
+	entry->loader_image = manifest_image (m, entry->loader, dev);
+	if (!entry->loader_image)
+	    return -1;
+    }
+
+    /* EEPROM images get built from the file each time */
+    if (entry->config < 0 && !entry->firmware_image) {
+	entry->firmware_image = manifest_image (m, entry->firmware, dev);
+	if (!entry->firmware_image)
+	    return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,76 @@
+#ifndef __manifest_H
+#define __manifest_H
+/*
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+#include "ezusb.h"
+#include "usbdev.h"
+
+/*
+ * A manifest says what to load into which devices, one line each:
+ *
+ *	# comment
+ *	04b4:8613 type=fx2lp firmware=board.hex
+ *	04b4:8613 bcd=a001 port=1-1.4 type=fx2 firmware=rev1.hex
+ *	0547:2131 type=an21 loader=a3load.hex firmware=boot.hex config=0
+ *	0582:0010 type=fx2 firmware=audio.hex priority=10 deadline=500
+ *
+ * The first field is the VID:PID.  An entry with "bcd" (bcdDevice)
+ * or "port" (sysfs port path) only applies to those devices, and is
+ * preferred over one without.  "config" writes the firmware into the
+ * EEPROM using that config byte, which needs a "loader".  Relative
+ * paths are relative to the manifest.  "priority" and "deadline" (in
+ * milliseconds after the device appears) order resident loads.
+ */
+struct manifest_entry {
+    unsigned short		vid, pid;
+    int				bcd;		/* -1 for any */
+    const char			*port;		/* NULL for any */
+    const char			*type;
+    const char			*firmware;
+    const char			*loader;	/* second stage loader */
+    int				config;		/* -1 for RAM */
+    int				priority;	/* higher loads first */
+    unsigned			deadline;	/* msec, or zero */
+
+    /* parsed on first use, and shared with other entries */
+    struct ezusb_image		*firmware_image;
+    struct ezusb_image		*loader_image;
+
+    unsigned			line;
+    struct manifest_entry	*next;		/* hash chain */
+};
+
+struct manifest;
+
+/* reads the manifest and indexes it; returns NULL after reporting errors */
+extern struct manifest *manifest_read (const char *path);
+extern void manifest_free (struct manifest *m);
+
+/* returns the best entry for this device, or NULL if there's none */
+extern struct manifest_entry *manifest_lookup (struct manifest *m,
+	const struct usbdev *dev);
+
+/*
+ * Parses whatever hexfiles the entry needs, unless some earlier entry
+ * already did, reporting errors through the library context.  Returns
+ * zero, else negative.
+ */
+extern int manifest_prepare (struct manifest *m,
+	struct manifest_entry *entry, struct ezusb *dev);
+
+#endif
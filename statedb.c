@@ -0,0 +1,301 @@
+/*
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+/*
+ * The state database file:  a header, then a power of two slots, each
+ * a key and two copies of its record.  Keys are only ever added, and
+ * ports don't come and go much, so a fixed table is plenty.  Updates
+ * hold an flock on the file, so concurrent fxload processes don't
+ * claim the same slot; lookups take no lock, relying on checksums.
+ */
+
+# include  <stdio.h>
+# include  <errno.h>
+# include  <stdlib.h>
+# include  <string.h>
+
+# include  <fcntl.h>
+# include  <unistd.h>
+# include  <sys/mman.h>
+# include  <sys/stat.h>
+# include  <sys/file.h>
+
+# include "ezusb.h"
+# include "statedb.h"
+
+extern void logerror(const char *format, ...)
+    __attribute__ ((format (printf, 1, 2)));
+
+#define STATEDB_MAGIC		"fxloadS1"
+#define STATEDB_SLOTS		1024
+#define STATEDB_KEY		48
+
+struct statedb_copy {
+    unsigned			seq;		/* zero if never written */
+    unsigned			check;
+    struct statedb_record	rec;
+};
+
+struct statedb_slot {
+    char			key [STATEDB_KEY];
+    struct statedb_copy		copy [2];
+};
+
+struct statedb_header {
+    char			magic [8];
+    unsigned			slots;
+    unsigned			slot_size;
+    char			pad [48];
+};
+
+struct statedb_file {
+    struct statedb_header	header;
+    struct statedb_slot		slot [STATEDB_SLOTS];
+};
+
+struct statedb {
+    int				fd;
+    struct statedb_file		*file;
+};
+
+static unsigned statedb_fnv (const void *buf, size_t len, unsigned hash)
+{
+    const unsigned char		*cp = buf;
+
+    while (len--)
+	hash = (hash ^ *cp++) * 16777619u;
+    return hash;
+}
+
+static unsigned statedb_check (const struct statedb_copy *copy)
+{
+    unsigned			hash = 2166136261u;
+
+    hash = statedb_fnv (&copy->seq, sizeof copy->seq, hash);
+    return statedb_fnv (&copy->rec, sizeof copy->rec, hash);
+}
+
+/* returns the index of the newest intact copy, else -1 */
+static int statedb_newest (const struct statedb_copy copy [2])
+{
+    int				i, newest = -1;
+
+    for (i = 0; i < 2; i++) {
+	if (!copy [i].seq || copy [i].check != statedb_check (&copy [i]))
+	    continue;
+	if (newest < 0 || (int) (copy [i].seq - copy [newest].seq) > 0)
+	    newest = i;
+    }
+    return newest;
+}
+
+/* finds the key's slot, or (if claim) the empty slot it would go in */
+static struct statedb_slot *statedb_slot (struct statedb *db,
+	const char *key, int claim)
+{
+    unsigned			i, n;
+
+    i = statedb_fnv (key, strlen (key), 2166136261u);
+    for (n = 0; n < STATEDB_SLOTS; n++, i++) {
+	struct statedb_slot	*slot = &db->file->slot [i % STATEDB_SLOTS];
+
+	if (!slot->key [0])
+	    return claim ? slot : NULL;
+	if (strncmp (slot->key, key, STATEDB_KEY) == 0)
+	    return slot;
+    }
+    return NULL;
+}
+
+/* syncs the pages holding this part of the file */
+static void statedb_sync (void *start, size_t len)
+{
+    long			page = sysconf (_SC_PAGESIZE);
+    unsigned long		addr = (unsigned long) start;
+
+    len += addr & (page - 1);
+    addr &= ~(page - 1);
+    msync ((void *) addr, len, MS_SYNC);
+}
+
+struct statedb *statedb_open (const char *path)
+{
+    struct statedb		*db;
+    struct stat			st;
+    char			*dir, *cp;
+    char			magic [8];
+
+    db = calloc (1, sizeof *db);
+    if (!db)
+	return NULL;
+
+    db->fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (db->fd < 0 && errno == ENOENT && (dir = strdup (path)) != 0) {
+	if ((cp = strrchr (dir, '/')) != 0 && cp != dir) {
+	    *cp = 0;
+	    mkdir (dir, 0755);
+	}
+	free (dir);
+	db->fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    }
+    if (db->fd < 0) {
+	logerror("%s: %s\n", path, strerror (errno));
+	free (db);
+	return NULL;
+    }
+
+    /* whoever creates the file sets it up before anyone else uses it;
+     * anything else that's there is left alone.  Setup writes the magic
+     * last, so a file whose magic is still zeroes was ours.
+     */
+    flock (db->fd, LOCK_EX);
+    if (fstat (db->fd, &st) < 0)
+	goto fail;
+    if (st.st_size != 0) {
+	memset (magic, 0, sizeof magic);
+	if (pread (db->fd, magic, sizeof magic, 0) < 0)
+	    goto fail;
+	if (memcmp (magic, STATEDB_MAGIC, sizeof magic) != 0
+		&& memcmp (magic, "\0\0\0\0\0\0\0\0", sizeof magic) != 0) {
+	    logerror("%s: not a state database, not using it\n", path);
+	    close (db->fd);
+	    free (db);
+	    return NULL;
+	}
+    }
+    if (st.st_size != sizeof *db->file
+	    && (ftruncate (db->fd, 0) < 0
+		|| ftruncate (db->fd, sizeof *db->file) < 0))
+	goto fail;
+    db->file = mmap (NULL, sizeof *db->file, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, db->fd, 0);
+    if (db->file == MAP_FAILED)
+	goto fail;
+    if (memcmp (db->file->header.magic, STATEDB_MAGIC, 8) != 0
+	    || db->file->header.slots != STATEDB_SLOTS
+	    || db->file->header.slot_size != sizeof (struct statedb_slot)) {
+	if (st.st_size != 0)
+	    logerror("%s: old or damaged state database, reinitialized\n",
+		path);
+	memset (db->file, 0, sizeof *db->file);
+	db->file->header.slots = STATEDB_SLOTS;
+	db->file->header.slot_size = sizeof (struct statedb_slot);
+	statedb_sync (db->file, sizeof *db->file);
+	memcpy (db->file->header.magic, STATEDB_MAGIC, 8);
+	statedb_sync (db->file, sizeof db->file->header);
+    }
+    flock (db->fd, LOCK_UN);
+    return db;
+
+fail:
+    logerror("%s: %s\n", path, strerror (errno));
+    if (db->file && db->file != MAP_FAILED)
+	munmap (db->file, sizeof *db->file);
+    close (db->fd);
+    free (db);
+    return NULL;
+}
+
+void statedb_close (struct statedb *db)
+{
+    if (!db)
+	return;
+    munmap (db->file, sizeof *db->file);
+    close (db->fd);
+    free (db);
+}
+
+int statedb_lookup (struct statedb *db, const char *key,
+	struct statedb_record *rec)
+{
+    struct statedb_slot		*slot;
+    struct statedb_copy		copy [2];
+    int				i;
+
+    slot = statedb_slot (db, key, 0);
+    if (!slot)
+	return -ENOENT;
+
+    /* check what was copied, since a writer may be busy with it */
+    memcpy (copy, slot->copy, sizeof copy);
+    i = statedb_newest (copy);
+    if (i < 0)
+	return -ENOENT;
+    *rec = copy [i].rec;
+    return 0;
+}
+
+int statedb_update (struct statedb *db, const char *key,
+	const struct statedb_record *rec)
+{
+    struct statedb_slot		*slot;
+    struct statedb_copy		*copy;
+    unsigned			seq = 1;
+    int				newest, status = 0;
+
+    if (!key [0] || strlen (key) >= STATEDB_KEY)
+	return -EINVAL;
+
+    while (flock (db->fd, LOCK_EX) < 0) {
+	if (errno != EINTR)
+	    return -errno;
+    }
+    slot = statedb_slot (db, key, 1);
+    if (!slot) {
+	status = -ENOSPC;
+	goto done;
+    }
+    if (!slot->key [0]) {
+	strcpy (slot->key, key);
+	statedb_sync (slot->key, sizeof slot->key);
+    }
+
+    /* overwrite the older copy, keeping the newer one intact */
+    newest = statedb_newest (slot->copy);
+    if (newest >= 0) {
+	seq = slot->copy [newest].seq + 1;
+	if (!seq)
+	    seq = 1;
+    }
+    copy = &slot->copy [newest == 0];
+    copy->seq = seq;
+    copy->rec = *rec;
+    copy->check = statedb_check (copy);
+    statedb_sync (copy, sizeof *copy);
+
+done:
+    flock (db->fd, LOCK_UN);
+    return status;
+}
+
+unsigned long long statedb_hash_file (const char *path)
+{
+    unsigned long long		hash = 14695981039346656037ull;
+    unsigned char		buf [4096];
+    ssize_t			len, i;
+    int				fd;
+
+    fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+	return 0;
+    while ((len = read (fd, buf, sizeof buf)) > 0) {
+	for (i = 0; i < len; i++)
+	    hash = (hash ^ buf [i]) * 1099511628211ull;
+    }
+    close (fd);
+    return len < 0 ? 0 : hash;
+}
@@ -0,0 +1,67 @@
+#ifndef __statedb_H
+#define __statedb_H
+/*
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+/*
+ * What was last loaded into each device, kept on disk between runs so
+ * repeated, partial, or resumed loads can be recognized.  Records are
+ * keyed by a string (the port path, or a serial number) and live in a
+ * fixed size hash table in a mapped file, so looking one up costs a
+ * hash and a probe or two, with no parsing and no system calls.
+ *
+ * Each slot holds two copies of its record.  An update rewrites the
+ * older copy, checksummed, and syncs it; a crash midway leaves a copy
+ * whose checksum fails, so readers just see the previous record.
+ */
+
+#define STATEDB_DEFAULT		"/var/lib/fxload/state"
+
+#define STATEDB_RAM		1	/* firmware loaded into RAM */
+#define STATEDB_EEPROM		2	/* boot image written to EEPROM */
+#define STATEDB_ERASED		3	/* EEPROM erased or invalidated */
+
+struct statedb_record {
+    unsigned long long	hash;		/* of the firmware file */
+    long long		loaded;		/* time(), when it was loaded */
+    unsigned short	vid, pid;	/* before loading */
+    unsigned char	what;		/* STATEDB_* */
+    unsigned char	loader;		/* second stage loader left running */
+    /* EEPROM layout, unless STATEDB_RAM */
+    short		config;		/* config byte */
+    unsigned char	large;		/* 16 bit addresses */
+    unsigned short	page_size;	/* zero if it was guessed */
+};
+
+struct statedb;
+
+/* creates the file if needed; returns NULL after reporting errors */
+extern struct statedb *statedb_open (const char *path);
+extern void statedb_close (struct statedb *db);
+
+/* returns zero and copies the record if there is one, else negative */
+extern int statedb_lookup (struct statedb *db, const char *key,
+	struct statedb_record *rec);
+
+/* replaces (or adds) the key's record; returns zero, else negative errno */
+extern int statedb_update (struct statedb *db, const char *key,
+	const struct statedb_record *rec);
+
+/* FNV-1a of a file's contents, zero if it can't be read */
+extern unsigned long long statedb_hash_file (const char *path);
+
+#endif
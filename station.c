@@ -0,0 +1,225 @@
+/*
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+/*
+ * Station statistics.  Histogram buckets are log-linear:  exact below
+ * 16 msec, then eight per power of two, so 240 buckets cover anything
+ * up to weeks with bounded relative error.  Children update counters
+ * with atomic adds; nobody ever takes a lock.
+ */
+
+# include  <stdio.h>
+# include  <errno.h>
+# include  <string.h>
+# include  <time.h>
+
+# include  <sys/mman.h>
+
+# include "station.h"
+
+extern void logerror(const char *format, ...)
+    __attribute__ ((format (printf, 1, 2)));
+
+#define STATION_EXACT		16
+#define STATION_SUB		8		/* buckets per octave */
+#define STATION_BUCKETS		(STATION_EXACT + 28 * STATION_SUB)
+
+struct station_hist {
+    unsigned		count;
+    unsigned		max;		/* msec */
+    unsigned		bucket [STATION_BUCKETS];
+};
+
+struct station {
+    long long		started;
+    unsigned		boards, failed;
+    unsigned		failed_in [STATION_PHASES];
+    struct station_hist	hist [STATION_PHASES];
+};
+
+static const char *const station_names [STATION_PHASES] = {
+    "loader", "firmware", "renumerate", "total",
+};
+
+static long long station_now (void)
+{
+    struct timespec	now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+static unsigned station_bucket (unsigned msec)
+{
+    unsigned		octave;
+
+    if (msec < STATION_EXACT)
+	return msec;
+    for (octave = 4; octave < 31 && (msec >> (octave + 1)); octave++)
+	continue;
+    return STATION_EXACT + (octave - 4) * STATION_SUB
+	+ ((msec >> (octave - 3)) & (STATION_SUB - 1));
+}
+
+/* the middle of the bucket's range */
+static unsigned station_value (unsigned bucket)
+{
+    unsigned		octave, step;
+
+    if (bucket < STATION_EXACT)
+	return bucket;
+    bucket -= STATION_EXACT;
+    octave = bucket / STATION_SUB + 4;
+    step = 1 << (octave - 3);
+    return (STATION_SUB + bucket % STATION_SUB) * step + step / 2;
+}
+
+static void station_add (struct station_hist *h, unsigned msec)
+{
+    unsigned		max;
+
+    __sync_fetch_and_add (&h->count, 1);
+    __sync_fetch_and_add (&h->bucket [station_bucket (msec)], 1);
+    while ((max = h->max) < msec)
+	__sync_val_compare_and_swap (&h->max, max, msec);
+}
+
+/* returns the pct'th percentile, in msec */
+static unsigned station_percentile (const struct station_hist *h,
+	unsigned count, unsigned pct)
+{
+    unsigned		want, seen = 0, i;
+
+    want = (count * pct + 99) / 100;
+    for (i = 0; i < STATION_BUCKETS; i++) {
+	seen += h->bucket [i];
+	if (seen >= want)
+	    break;
+    }
+    if (i == STATION_BUCKETS)
+	return h->max;
+    return station_value (i) < h->max ? station_value (i) : h->max;
+}
+
+struct station *station_open (void)
+{
+    struct station	*s;
+
+    /* shared, so children can update it */
+    s = mmap (NULL, sizeof *s, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (s == MAP_FAILED) {
+	logerror("can't set up station statistics: %s\n", strerror (errno));
+	return NULL;
+    }
+    memset (s, 0, sizeof *s);
+    s->started = station_now ();
+    return s;
+}
+
+void station_close (struct station *s)
+{
+    if (s)
+	munmap (s, sizeof *s);
+}
+
+void station_begin (struct station_board *b, unsigned expect)
+{
+    unsigned		i;
+
+    b->start = station_now ();
+    b->expect = expect | (1 << STATION_TOTAL);
+    for (i = 0; i < STATION_PHASES; i++)
+	b->done [i] = -1;
+}
+
+void station_mark (struct station_board *b, enum station_phase phase)
+{
+    if (b)
+	b->done [phase] = station_now () - b->start;
+}
+
+void station_record (struct station *s, const struct station_board *b,
+	const char *port, int status)
+{
+    long long		prev = 0, total;
+    unsigned		board, i;
+
+    board = __sync_add_and_fetch (&s->boards, 1);
+    if (status != 0) {
+	__sync_fetch_and_add (&s->failed, 1);
+
+	/* blame the first phase that didn't finish */
+	for (i = 0; i < STATION_TOTAL; i++) {
+	    if ((b->expect & (1 << i)) && b->done [i] < 0)
+		break;
+	}
+	__sync_fetch_and_add (&s->failed_in [i], 1);
+	logerror("board %u, port %s: failed in %s phase\n",
+		board, port, station_names [i]);
+	return;
+    }
+
+    /* each phase's latency, excluding those before it */
+    for (i = 0; i < STATION_TOTAL; i++) {
+	if (b->done [i] < 0)
+	    continue;
+	station_add (&s->hist [i], (b->done [i] - prev) / 1000);
+	prev = b->done [i];
+    }
+    total = (station_now () - b->start) / 1000;
+    station_add (&s->hist [STATION_TOTAL], total);
+    logerror("board %u, port %s: ok, %lld msec\n", board, port, total);
+}
+
+/* one message, so reports from concurrent boards don't interleave */
+void station_report (struct station *s)
+{
+    char		buf [1024];
+    unsigned		boards = s->boards, failed = s->failed, i;
+    long long		elapsed = station_now () - s->started;
+    size_t		len;
+
+    if (!boards)
+	return;
+    len = snprintf (buf, sizeof buf,
+	    "station: %u boards, %u failed (%.1f%%), %.0f boards/hour\n",
+	    boards, failed, 100.0 * failed / boards,
+	    elapsed > 0 ? boards * 3600e6 / elapsed : 0.0);
+    for (i = 0; i < STATION_PHASES && len < sizeof buf; i++) {
+	const struct station_hist	*h = &s->hist [i];
+	unsigned			count = h->count;
+
+	if (!count && !s->failed_in [i])
+	    continue;
+	len += snprintf (buf + len, sizeof buf - len, "  %-10s", station_names [i]);
+	if (count && len < sizeof buf)
+	    len += snprintf (buf + len, sizeof buf - len,
+		" p50 %u p90 %u p99 %u max %u msec",
+		station_percentile (h, count, 50),
+		station_percentile (h, count, 90),
+		station_percentile (h, count, 99),
+		h->max);
+	if (s->failed_in [i] && len < sizeof buf)
+	    len += snprintf (buf + len, sizeof buf - len,
+		", %u failed (%.1f%%)", s->failed_in [i],
+		100.0 * s->failed_in [i] / boards);
+	if (len < sizeof buf)
+	    len += snprintf (buf + len, sizeof buf - len, "\n");
+    }
+    logerror("%s", buf);
+}
@@ -0,0 +1,58 @@
+#ifndef __station_H
+#define __station_H
+/*
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+/*
+ * Production line statistics, for a resident loader that programs
+ * board after board.  The counters live in shared memory, so each
+ * board's child process adds its own results, and nothing grows with
+ * the number of boards:  latencies go into fixed size histograms, from
+ * which percentiles are reported to within about 6%.
+ */
+
+enum station_phase {
+    STATION_LOADER,		/* second stage loader into RAM */
+    STATION_FIRMWARE,		/* firmware into RAM or EEPROM (verified) */
+    STATION_RENUMERATE,		/* board comes back running it */
+    STATION_TOTAL,		/* the whole sequence */
+    STATION_PHASES
+};
+
+/* one board's timings, in microseconds since station_begin() */
+struct station_board {
+    long long		start;
+    unsigned		expect;		/* bitmask of phases */
+    long long		done [STATION_PHASES];	/* -1 until done */
+};
+
+struct station;
+
+/* returns NULL after reporting errors */
+extern struct station *station_open (void);
+extern void station_close (struct station *s);
+
+/* per board:  begin, mark each phase as it finishes, then record */
+extern void station_begin (struct station_board *b, unsigned expect);
+extern void station_mark (struct station_board *b, enum station_phase phase);
+extern void station_record (struct station *s, const struct station_board *b,
+	const char *port, int status);
+
+/* reports boards/hour, failure rates, and latency percentiles */
+extern void station_report (struct station *s);
+
+#endif
@@ -0,0 +1,240 @@
+/*
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+/*
+ * Transports that don't need a USB device:  a fake EZ-USB device in
+ * memory, and a recorder wrapping some other transport.  With these the
+ * loader can be tested, and its requests counted and compared, on any
+ * machine.  Only the public libfxload API is used here.
+ */
+
+# include  <stdio.h>
+# include  <errno.h>
+# include  <stdlib.h>
+# include  <string.h>
+
+# include  <linux/usb/ch9.h>
+
+# include "ezusb.h"
+
+/* vendor requests, as in ezusb.c */
+#define RW_INTERNAL	0xA0
+#define RW_EEPROM	0xA2
+#define RW_MEMORY	0xA3
+#define GET_EEPROM_SIZE	0xA5
+#define RW_EEPROM_LARGE	0xA9
+
+struct ezusb_fake {
+    unsigned short	cpucs;		/* its address */
+    int			running;
+    unsigned char	ram [0x10000];
+    unsigned		eeprom_size;
+    unsigned char	*eeprom;
+
+    /* the part commits each write a page at a time */
+    unsigned		page_size;
+    unsigned long	page_writes;
+};
+
+struct ezusb_fake *ezusb_fake_new (int fx2, unsigned eeprom_size)
+{
+    struct ezusb_fake	*fake;
+
+    if (eeprom_size < 256 || (eeprom_size & (eeprom_size - 1)) != 0) {
+	errno = EINVAL;
+	return NULL;
+    }
+    fake = calloc (1, sizeof *fake);
+    if (!fake)
+	return NULL;
+    fake->eeprom = malloc (eeprom_size);
+    if (!fake->eeprom) {
+	free (fake);
+	return NULL;
+    }
+    memset (fake->eeprom, 0xff, eeprom_size);
+    fake->eeprom_size = eeprom_size;
+    fake->page_size = 32;
+    fake->cpucs = fx2 ? 0xe600 : 0x7f92;
+    return fake;
+}
+
+void ezusb_fake_free (struct ezusb_fake *fake)
+{
+    if (!fake)
+	return;
+    free (fake->eeprom);
+    free (fake);
+}
+
+/* EEPROM addresses wrap, as on real parts */
+static int fake_access (struct ezusb_fake *fake, int space, unsigned addr,
+	unsigned char *buf, unsigned len, int write)
+{
+    unsigned		i;
+
+    switch (space) {
+    case EZUSB_FAKE_RAM:
+	if (addr + len > sizeof fake->ram)
+	    return -EINVAL;
+	if (write)
+	    memcpy (fake->ram + addr, buf, len);
+	else
+	    memcpy (buf, fake->ram + addr, len);
+	return 0;
+    case EZUSB_FAKE_EEPROM:
+	for (i = 0; i < len; i++) {
+	    unsigned char	*byte;
+
+	    byte = fake->eeprom + ((addr + i) & (fake->eeprom_size - 1));
+	    if (write)
+		*byte = buf [i];
+	    else
+		buf [i] = *byte;
+	}
+	return 0;
+    }
+    return -EINVAL;
+}
+
+void ezusb_fake_set_page_size (struct ezusb_fake *fake, unsigned page_size)
+{
+    fake->page_size = page_size ? page_size : 1;
+}
+
+unsigned long ezusb_fake_page_writes (const struct ezusb_fake *fake)
+{
+    return fake->page_writes;
+}
+
+int ezusb_fake_peek (struct ezusb_fake *fake, int space,
+	unsigned addr, unsigned char *buf, unsigned len)
+{
+    return fake_access (fake, space, addr, buf, len, 0);
+}
+
+int ezusb_fake_poke (struct ezusb_fake *fake, int space,
+	unsigned addr, const unsigned char *buf, unsigned len)
+{
+    return fake_access (fake, space, addr, (unsigned char *) buf, len, 1);
+}
+
+static int fake_control (struct ezusb *dev, void *arg,
+	const struct ezusb_ctrl *ctrl)
+{
+    struct ezusb_fake	*fake = arg;
+    int			in = ctrl->request_type & USB_DIR_IN;
+    unsigned		addr = ctrl->value | (ctrl->index << 16);
+    int			status;
+
+    if ((ctrl->request_type & USB_TYPE_MASK) != USB_TYPE_VENDOR)
+	return -EPIPE;
+
+    switch (ctrl->request) {
+    case RW_INTERNAL:		/* the hardware does these */
+	if (addr >= sizeof fake->ram)
+	    return -EPIPE;
+	status = fake_access (fake, EZUSB_FAKE_RAM, addr,
+		ctrl->data, ctrl->length, !in);
+	if (status == 0 && !in && ctrl->length
+		&& addr <= fake->cpucs && fake->cpucs < addr + ctrl->length)
+	    fake->running = !(ctrl->data [fake->cpucs - addr] & 1);
+	break;
+    case RW_MEMORY:
+	if (!fake->running)
+	    return -EPIPE;
+	status = fake_access (fake, EZUSB_FAKE_RAM, addr,
+		ctrl->data, ctrl->length, !in);
+	break;
+    case RW_EEPROM:
+    case RW_EEPROM_LARGE:
+	if (!fake->running)
+	    return -EPIPE;
+	status = fake_access (fake, EZUSB_FAKE_EEPROM, addr,
+		ctrl->data, ctrl->length, !in);
+	if (status == 0 && !in && ctrl->length)
+	    fake->page_writes += (addr + ctrl->length - 1) / fake->page_size
+		- addr / fake->page_size + 1;
+	break;
+    case GET_EEPROM_SIZE:
+	if (!fake->running || !in || ctrl->length < 1)
+	    return -EPIPE;
+	ctrl->data [0] = fake->eeprom_size > 256;	/* 16 bit addresses */
+	return 1;
+    default:
+	return -EPIPE;
+    }
+    return (status < 0) ? -EPIPE : ctrl->length;
+}
+
+const struct ezusb_transport ezusb_fake_transport = {
+    .name =	"fake",
+    .control =	fake_control,
+};
+
+
+struct ezusb_recorder {
+    FILE			*f;
+    const struct ezusb_transport *transport;
+    void			*arg;
+};
+
+struct ezusb_recorder *ezusb_recorder_new (FILE *f,
+	const struct ezusb_transport *transport, void *arg)
+{
+    struct ezusb_recorder	*rec = calloc (1, sizeof *rec);
+
+    if (!rec)
+	return NULL;
+    rec->f = f;
+    rec->transport = transport;
+    rec->arg = arg;
+    return rec;
+}
+
+void ezusb_recorder_free (struct ezusb_recorder *rec)
+{
+    free (rec);
+}
+
+static int recorder_control (struct ezusb *dev, void *arg,
+	const struct ezusb_ctrl *ctrl)
+{
+    struct ezusb_recorder	*rec = arg;
+    int				status, i, len;
+
+    status = rec->transport->control (dev, rec->arg, ctrl);
+
+    fprintf (rec->f, "%02x %02x %04x %04x %04x = %d",
+	    ctrl->request_type, ctrl->request,
+	    ctrl->value, ctrl->index, ctrl->length, status);
+    if (ctrl->request_type & USB_DIR_IN)
+	len = (status > 0) ? status : 0;
+    else
+	len = ctrl->length;
+    if (len)
+	fputc (' ', rec->f);
+    for (i = 0; i < len; i++)
+	fprintf (rec->f, "%02x", ctrl->data [i]);
+    fputc ('\n', rec->f);
+    return status;
+}
+
+const struct ezusb_transport ezusb_recorder_transport = {
+    .name =	"recorder",
+    .control =	recorder_control,
+};
@@ -0,0 +1,386 @@
+/*
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+/*
+ * Finds USB devices by reading sysfs directly, rather than being told
+ * (or running lsusb to learn) their usbfs paths.  Each device's
+ * "uevent" file holds everything needed except the serial number, so
+ * that's one read per device; nothing else gets opened unless a serial
+ * number must match.
+ */
+
+# include  <stdio.h>
+# include  <errno.h>
+# include  <stdlib.h>
+# include  <string.h>
+
+# include  <fcntl.h>
+# include  <unistd.h>
+# include  <dirent.h>
+# include  <time.h>
+# include  <sys/file.h>
+# include  <sys/stat.h>
+# include  <sys/socket.h>
+# include  <linux/netlink.h>
+
+# include "usbdev.h"
+
+# define USB_SYSFS_DEVICES	"/sys/bus/usb/devices"
+# define USB_DEVFS		"/dev/"
+# define USBDEV_LOCK_DIR	"/run/fxload"
+
+/* copies a field value, which isn't NUL terminated */
+static void usbdev_copy (char *to, size_t size, const char *from, size_t len)
+{
+    if (len >= size)
+	len = size - 1;
+    memcpy (to, from, len);
+    to [len] = 0;
+}
+
+int usbdev_parse_uevent (const char *buf, size_t len, struct usbdev *dev)
+{
+    const char		*end = buf + len;
+    const char		*line, *eol, *value;
+    char		tmp [32];
+    int			is_device = 0, have_product = 0;
+    unsigned		vid, pid, bcd;
+
+    dev->path [0] = 0;
+    dev->busnum = dev->devnum = 0;
+    for (line = buf; line < end; line = eol + 1) {
+	for (eol = line; eol < end && *eol != '\n' && *eol != 0; eol++)
+	    continue;
+	value = memchr (line, '=', eol - line);
+	if (!value)
+	    continue;
+	value++;
+
+#define	KEY(k)	(value - line == sizeof k && memcmp (line, k "=", sizeof k) == 0)
+	if (KEY ("DEVTYPE")) {
+	    is_device = (eol - value == 10
+		    && memcmp (value, "usb_device", 10) == 0);
+	} else if (KEY ("PRODUCT")) {
+	    usbdev_copy (tmp, sizeof tmp, value, eol - value);
+	    if (sscanf (tmp, "%x/%x/%x", &vid, &pid, &bcd) == 3) {
+		dev->vid = vid;
+		dev->pid = pid;
+		dev->bcd = bcd;
+		have_product = 1;
+	    }
+	} else if (KEY ("DEVNAME")) {
+	    /* kernels have long said "bus/usb/BBB/DDD" here */
+	    snprintf (dev->path, sizeof dev->path, USB_DEVFS "%.*s",
+		    (int) (eol - value), value);
+	} else if (KEY ("BUSNUM")) {
+	    dev->busnum = strtoul (value, 0, 10);
+	} else if (KEY ("DEVNUM")) {
+	    dev->devnum = strtoul (value, 0, 10);
+	} else if (KEY ("DEVPATH")) {
+	    const char	*base = eol;
+
+	    while (base > value && base [-1] != '/')
+		base--;
+	    usbdev_copy (dev->name, sizeof dev->name, base, eol - base);
+	}
+#undef	KEY
+    }
+
+    if (!is_device || !have_product)
+	return -ENODEV;
+
+    /* older kernels didn't say DEVNAME */
+    if (!dev->path [0]) {
+	if (!dev->busnum || dev->busnum > 999
+		|| !dev->devnum || dev->devnum > 999)
+	    return -ENODEV;
+	snprintf (dev->path, sizeof dev->path, USB_DEVFS "bus/usb/%03u/%03u",
+		dev->busnum, dev->devnum);
+    }
+    return 0;
+}
+
+/* reads a small sysfs file into buf, NUL terminated; returns its length */
+static int usbdev_read_attr (int dir, const char *name, const char *attr,
+	char *buf, size_t size)
+{
+    char		path [64];
+    int			fd, len;
+
+    snprintf (path, sizeof path, "%s/%s", name, attr);
+    fd = openat (dir, path, O_RDONLY);
+    if (fd < 0)
+	return -errno;
+    len = read (fd, buf, size - 1);
+    if (len < 0)
+	len = -errno;
+    close (fd);
+    if (len >= 0)
+	buf [len] = 0;
+    return len;
+}
+
+static int usbdev_match_at (int dir, const struct usbdev *dev,
+	const struct usbdev_match *match)
+{
+    char		serial [256];
+    int			len;
+
+    if (match->vid >= 0 && match->vid != dev->vid)
+	return 0;
+    if (match->pid >= 0 && match->pid != dev->pid)
+	return 0;
+    if (match->port && strcmp (match->port, dev->name) != 0)
+	return 0;
+    if (!match->serial)
+	return 1;
+
+    len = usbdev_read_attr (dir, dev->name, "serial", serial, sizeof serial);
+    if (len <= 0)
+	return 0;
+    if (serial [len - 1] == '\n')
+	serial [--len] = 0;
+    return strcmp (match->serial, serial) == 0;
+}
+
+int usbdev_match (const struct usbdev *dev, const struct usbdev_match *match)
+{
+    int			dir, status;
+
+    if (!match->serial)
+	return usbdev_match_at (-1, dev, match);
+    dir = open (USB_SYSFS_DEVICES, O_RDONLY | O_DIRECTORY);
+    if (dir < 0)
+	return 0;
+    status = usbdev_match_at (dir, dev, match);
+    close (dir);
+    return status;
+}
+
+int usbdev_scan (const struct usbdev_match *match,
+	int (*fn) (const struct usbdev *dev, void *context), void *context)
+{
+    DIR			*dir;
+    struct dirent	*entry;
+    struct usbdev	dev;
+    char		buf [512];
+    int			len, count = 0;
+
+    dir = opendir (USB_SYSFS_DEVICES);
+    if (!dir)
+	return -errno;
+
+    while ((entry = readdir (dir)) != 0) {
+	/* skip ".", "..", and interfaces like "1-1.4:1.0" */
+	if (entry->d_name [0] == '.' || strchr (entry->d_name, ':'))
+	    continue;
+	if (strlen (entry->d_name) >= sizeof dev.name)
+	    continue;
+
+	len = usbdev_read_attr (dirfd (dir), entry->d_name, "uevent",
+		buf, sizeof buf);
+	if (len <= 0)
+	    continue;
+	memset (&dev, 0, sizeof dev);
+	if (usbdev_parse_uevent (buf, len, &dev) < 0)
+	    continue;
+	strcpy (dev.name, entry->d_name);
+
+	if (!usbdev_match_at (dirfd (dir), &dev, match))
+	    continue;
+	count++;
+	if (fn && fn (&dev, context) != 0)
+	    break;
+    }
+    closedir (dir);
+    return count;
+}
+
+/* usbdev_scan() callback for usbdev_find() */
+static int usbdev_find_path (const struct usbdev *dev, void *context)
+{
+    struct usbdev	*found = context;
+
+    if (strcmp (dev->path, found->path) != 0)
+	return 0;
+    *found = *dev;
+    return 1;
+}
+
+int usbdev_find (const char *path, struct usbdev *dev)
+{
+    struct usbdev_match	any = { -1, -1, 0, 0 };
+    int			status;
+
+    memset (dev, 0, sizeof *dev);
+    snprintf (dev->path, sizeof dev->path, "%s", path);
+    status = usbdev_scan (&any, usbdev_find_path, dev);
+    if (status < 0)
+	return status;
+    return dev->name [0] ? 0 : -ENODEV;
+}
+
+int usbdev_monitor (void)
+{
+    struct sockaddr_nl	addr;
+    int			fd, size = 1024 * 1024;
+
+    fd = socket (AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+	    NETLINK_KOBJECT_UEVENT);
+    if (fd < 0)
+	return -errno;
+
+    /* lots of devices can show up at once; don't drop their events */
+    if (setsockopt (fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof size) < 0)
+	setsockopt (fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+
+    memset (&addr, 0, sizeof addr);
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;		/* kernel events, not udev's */
+    if (bind (fd, (struct sockaddr *) &addr, sizeof addr) < 0) {
+	int	status = -errno;
+
+	close (fd);
+	return status;
+    }
+    return fd;
+}
+
+int usbdev_monitor_read (int fd, struct usbdev *dev)
+{
+    char		buf [8192];
+    struct sockaddr_nl	from;
+    struct iovec	iov = { buf, sizeof buf };
+    struct msghdr	msg;
+    ssize_t		len;
+    int			action;
+
+    memset (&msg, 0, sizeof msg);
+    msg.msg_name = &from;
+    msg.msg_namelen = sizeof from;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    len = recvmsg (fd, &msg, 0);
+    if (len < 0)
+	return -errno;
+
+    /* only trust the kernel; "add@/devices/..." then KEY=value */
+    if (from.nl_pid != 0)
+	return 0;
+    if (len > 4 && memcmp (buf, "add@", 4) == 0)
+	action = USBDEV_ADD;
+    else if (len > 7 && memcmp (buf, "remove@", 7) == 0)
+	action = USBDEV_REMOVE;
+    else
+	return 0;
+
+    memset (dev, 0, sizeof *dev);
+    if (usbdev_parse_uevent (buf, len, dev) < 0)
+	return 0;
+    return action;
+}
+
+long long usbdev_boottime (void)
+{
+    struct timespec	now;
+
+    clock_gettime (CLOCK_BOOTTIME, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/*
+ * Locks are kept on a file named for the port, not on the usbfs node,
+ * since the node changes whenever the device renumerates.  Without
+ * sysfs (or the lock directory), the node itself is locked.
+ */
+int usbdev_lock (const char *path, long long *waited)
+{
+    struct usbdev	dev;
+    char		file [sizeof USBDEV_LOCK_DIR + sizeof dev.name];
+    int			fd = -1, status;
+
+    if (usbdev_find (path, &dev) == 0
+	    && (mkdir (USBDEV_LOCK_DIR, 0755) == 0 || errno == EEXIST)) {
+	snprintf (file, sizeof file, USBDEV_LOCK_DIR "/%s", dev.name);
+	fd = open (file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    }
+    if (fd < 0)
+	fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+	return -errno;
+
+    *waited = -1;
+    if (flock (fd, LOCK_EX | LOCK_NB) == 0)
+	return fd;
+    if (errno == EWOULDBLOCK) {
+	*waited = usbdev_boottime ();
+	while ((status = flock (fd, LOCK_EX)) < 0 && errno == EINTR)
+	    continue;
+	if (status == 0)
+	    return fd;
+    }
+    status = -errno;
+    close (fd);
+    return status;
+}
+
+int usbdev_lock_loaded (int fd, const char *id, long long since)
+{
+    struct stat		st;
+    char		buf [512];
+    long long		when;
+    int			len, offset;
+
+    if (fstat (fd, &st) < 0 || !S_ISREG (st.st_mode))
+	return 0;
+    len = pread (fd, buf, sizeof buf - 1, 0);
+    if (len <= 0)
+	return 0;
+    buf [len] = 0;
+    buf [strcspn (buf, "\n")] = 0;
+    if (sscanf (buf, "%lld %n", &when, &offset) != 1)
+	return 0;
+    return when >= since && strcmp (buf + offset, id) == 0;
+}
+
+void usbdev_lock_record (int fd, const char *id)
+{
+    struct stat		st;
+    char		buf [512];
+    int			len;
+
+    if (fstat (fd, &st) < 0 || !S_ISREG (st.st_mode))
+	return;
+    len = snprintf (buf, sizeof buf, "%lld %s\n", usbdev_boottime (), id);
+    if (len >= (int) sizeof buf)
+	return;
+    if (ftruncate (fd, 0) < 0 || pwrite (fd, buf, len, 0) != len)
+	return;
+    fdatasync (fd);
+}
+
+int usbdev_parse_id (const char *s, int *vid, int *pid)
+{
+    unsigned		v, p;
+    char		c;
+
+    if (sscanf (s, "%x:%x%c", &v, &p, &c) != 2 || v > 0xffff || p > 0xffff)
+	return -EINVAL;
+    *vid = v;
+    *pid = p;
+    return 0;
+}
@@ -0,0 +1,98 @@
+#ifndef __usbdev_H
+#define __usbdev_H
+/*
+ *    This source code is free software; you can redistribute it
+ *    and/or modify it in source code form under the terms of the GNU
+ *    General Public License as published by the Free Software
+ *    Foundation; either version 2 of the License, or (at your option)
+ *    any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+/*
+ * What sysfs (or a kernel uevent) says about one USB device.  The
+ * sysfs name is also its port path:  "1-1.4" is bus 1, root hub
+ * port 1, then port 4 of the hub there.
+ */
+struct usbdev {
+    char		name [32];	/* sysfs name, the port path */
+    char		path [32];	/* usbfs node, /dev/bus/usb/BBB/DDD */
+    unsigned short	vid, pid;
+    unsigned short	bcd;		/* bcdDevice */
+    unsigned		busnum, devnum;
+};
+
+/* which devices to pick; -1 or NULL matches anything */
+struct usbdev_match {
+    int			vid, pid;
+    const char		*port;		/* sysfs name */
+    const char		*serial;	/* iSerialNumber string */
+};
+
+/*
+ * Parses uevent style KEY=value lines, separated by newlines (as in
+ * sysfs "uevent" files) or NULs (as in netlink messages).  Returns zero
+ * if they describe a USB device (not an interface), else negative.
+ * The name is only set if there's a DEVPATH; the caller knows it for
+ * sysfs files.
+ */
+extern int usbdev_parse_uevent (const char *buf, size_t len,
+	struct usbdev *dev);
+
+/* returns nonzero if the device matches; may read its serial number */
+extern int usbdev_match (const struct usbdev *dev,
+	const struct usbdev_match *match);
+
+/*
+ * Calls fn for each USB device in sysfs that matches, stopping if it
+ * returns nonzero.  Returns the number of matching devices, else
+ * negative errno.
+ */
+extern int usbdev_scan (const struct usbdev_match *match,
+	int (*fn) (const struct usbdev *dev, void *context), void *context);
+
+/* finds the sysfs entry (so, the port) for a usbfs path */
+extern int usbdev_find (const char *path, struct usbdev *dev);
+
+/*
+ * Kernel uevents, from a netlink socket, so udev isn't needed.
+ * usbdev_monitor() returns the (nonblocking) socket, else negative
+ * errno.  usbdev_monitor_read() returns USBDEV_ADD or USBDEV_REMOVE
+ * for USB devices, zero for other events, and -EAGAIN once there are
+ * no more; -ENOBUFS means events were lost.
+ */
+extern int usbdev_monitor (void);
+extern int usbdev_monitor_read (int fd, struct usbdev *dev);
+
+#define USBDEV_ADD	1
+#define USBDEV_REMOVE	2
+
+/*
+ * Takes an exclusive lock for the port the device is on, waiting for
+ * any other process using it to finish; returns the lock's file
+ * descriptor (close it to unlock), else negative errno.  If there was
+ * a wait, *waited says when it started, else it's -1.
+ */
+extern int usbdev_lock (const char *path, long long *waited);
+
+/* under the lock:  was the image with this id loaded since then? */
+extern int usbdev_lock_loaded (int fd, const char *id, long long since);
+
+/* under the lock:  records that the image with this id was loaded */
+extern void usbdev_lock_record (int fd, const char *id);
+
+/* milliseconds since boot (counting suspend); comparable between processes */
+extern long long usbdev_boottime (void);
+
+/* parses "VID:PID" (hex); returns zero, else negative */
+extern int usbdev_parse_id (const char *s, int *vid, int *pid);
+
+#endif